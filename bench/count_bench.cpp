@@ -0,0 +1,117 @@
+/*
+ * Microbenchmark for counting one task: compares sorting (PARADIS or RADULS)
+ * and scanning against the HashCounter engine (count_hashed_task) on the same
+ * synthetic tasks, for a range of distinct k-mer ratios, and checks that all
+ * three keep the same k-mers with the same counts. This is what the COUNT=0
+ * thresholds in count_decision are based on.
+ *
+ * Usage: count_bench [million k-mers per task] [sort threads]
+ */
+
+#include "kmerops.hpp"
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+/*
+ * @n k-mers drawn uniformly from @distinct random ones, so counts are
+ * about n / distinct each.
+ */
+static std::vector<KmerSeedStruct> make_task(size_t n, size_t distinct, std::mt19937_64& rng)
+{
+    constexpr int nlongs = TKmer::NBYTES / 8;
+    constexpr int unused = 2 * ((32 - (KMER_SIZE % 32)) % 32);
+
+    std::vector<TKmer> kmers(distinct);
+
+    for (auto& kmer : kmers)
+    {
+        uint64_t longs[nlongs];
+        for (int l = 0; l < nlongs; ++l) longs[l] = rng();
+        longs[nlongs-1] &= ~((1ULL << unused) - 1);
+        kmer = TKmer(longs);
+    }
+
+    std::vector<KmerSeedStruct> task;
+    task.reserve(n + 256 / TKmer::NBYTES); /* RADULS padding, as BucketAssistant reserves it */
+
+    for (size_t i = 0; i < n; ++i)
+        task.emplace_back(kmers[rng() % distinct]);
+
+    return task;
+}
+
+template <typename Count>
+static double time_count(Count count, const std::vector<KmerSeedStruct>& task, KmerListS& kmerlist, size_t& valid_kmer, int reps)
+{
+    double best = 1e30;
+
+    for (int r = 0; r < reps; ++r)
+    {
+        std::vector<KmerSeedStruct> copy;
+        copy.reserve(task.capacity());
+        copy = task;
+
+        auto t0 = std::chrono::steady_clock::now();
+        count(copy, kmerlist, valid_kmer);
+        auto t1 = std::chrono::steady_clock::now();
+
+        best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+
+    std::sort(kmerlist.begin(), kmerlist.end(), [](const auto& a, const auto& b) { return a.kmer < b.kmer; });
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = (argc > 1? std::strtoull(argv[1], nullptr, 10) : 8) * 1000000;
+    int thr = argc > 2? std::atoi(argv[2]) : 1;
+    int reps = 3;
+
+    std::mt19937_64 rng(1);
+    bool same = true;
+
+    std::cout << n << " k-mers per task, K=" << KMER_SIZE << ", " << thr << " sort thread(s), counts kept in [" << LOWER_KMER_FREQ << ", " << UPPER_KMER_FREQ << "]\n";
+    std::cout << "  distinct    PARADIS     RADULS       hash   (seconds)\n";
+
+    for (double ratio : {0.01, 0.05, 0.1, 0.25, 0.5, 1.0})
+    {
+        size_t distinct = std::max(static_cast<size_t>(1), static_cast<size_t>(n * ratio));
+        auto task = make_task(n, distinct, rng);
+
+        KmerListS paradis_list, raduls_list, hash_list;
+        size_t paradis_valid, raduls_valid, hash_valid;
+
+        double tparadis = time_count([&](std::vector<KmerSeedStruct>& seeds, KmerListS& kmerlist, size_t& valid_kmer) {
+            size_t start_pos;
+            sort_task(seeds, 1, thr, start_pos, n);
+            count_sorted_task(seeds, kmerlist, start_pos, n, valid_kmer);
+        }, task, paradis_list, paradis_valid, reps);
+
+        double traduls = time_count([&](std::vector<KmerSeedStruct>& seeds, KmerListS& kmerlist, size_t& valid_kmer) {
+            size_t start_pos;
+            sort_task(seeds, 2, thr, start_pos, n);
+            count_sorted_task(seeds, kmerlist, start_pos, n, valid_kmer);
+        }, task, raduls_list, raduls_valid, reps);
+
+        double thash = time_count([&](std::vector<KmerSeedStruct>& seeds, KmerListS& kmerlist, size_t& valid_kmer) {
+            count_hashed_task(seeds, kmerlist, n, distinct, valid_kmer);
+        }, task, hash_list, hash_valid, reps);
+
+        auto equal = [](const KmerListS& a, const KmerListS& b) {
+            return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const auto& x, const auto& y) { return x.kmer == y.kmer && x.cnt == y.cnt; });
+        };
+
+        bool agree = paradis_valid == raduls_valid && raduls_valid == hash_valid && equal(paradis_list, raduls_list) && equal(raduls_list, hash_list);
+        same = same && agree;
+
+        std::cout << std::fixed << std::setprecision(2) << std::setw(10) << ratio
+                  << std::setprecision(3) << std::setw(11) << tparadis << std::setw(11) << traduls << std::setw(11) << thash
+                  << "   " << paradis_valid << " k-mers kept" << (agree? "" : ", MISMATCH") << "\n";
+    }
+
+    return same? 0 : 1;
+}
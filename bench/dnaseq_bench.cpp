@@ -0,0 +1,79 @@
+/*
+ * Microbenchmark for DnaSeq 2-bit encoding: compares the vectorized
+ * DnaSeq::encode against the per-nucleotide DnaSeq::encode_scalar loop
+ * on random reads, and checks that both produce identical bytes. Reads are
+ * mixed case and now and then have an N or another IUPAC code, which both
+ * must encode as A.
+ *
+ * Usage: dnaseq_bench [total megabases] [read length]
+ */
+
+#include "dnaseq.hpp"
+#include <chrono>
+#include <random>
+#include <memory>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+template <typename Encoder>
+double time_encoder(Encoder encode, const std::string& ascii, size_t readlen, uint8_t *mem, int reps)
+{
+    double best = 1e30;
+
+    for (int r = 0; r < reps; ++r)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+
+        uint8_t *p = mem;
+        for (size_t pos = 0; pos < ascii.size(); pos += readlen)
+        {
+            size_t len = std::min(readlen, ascii.size() - pos);
+            encode(ascii.data() + pos, len, p);
+            p += DnaSeq::bytesneeded(len);
+        }
+
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    size_t totbases = (argc > 1? std::strtoull(argv[1], nullptr, 10) : 256) * 1000000;
+    size_t readlen = argc > 2? std::strtoull(argv[2], nullptr, 10) : 150;
+    int reps = 5;
+
+    std::mt19937_64 rng(1);
+    std::string ascii(totbases, 'A');
+    char const *other = "NnRYKMSWBDHVrykmswbdhv";
+    for (auto& c : ascii) c = rng() % 16? "ACGTacgt"[rng() % 8] : other[rng() % 22];
+
+    size_t nbytes = 0;
+    for (size_t pos = 0; pos < totbases; pos += readlen)
+        nbytes += DnaSeq::bytesneeded(std::min(readlen, totbases - pos));
+
+    std::unique_ptr<uint8_t[]> ref(new uint8_t[nbytes]);
+    std::unique_ptr<uint8_t[]> vec(new uint8_t[nbytes]);
+
+    double tscalar = time_encoder(DnaSeq::encode_scalar, ascii, readlen, ref.get(), reps);
+    double tvector = time_encoder(DnaSeq::encode, ascii, readlen, vec.get(), reps);
+
+    bool same = std::equal(ref.get(), ref.get() + nbytes, vec.get());
+
+#ifdef __AVX2__
+    char const *kernel = "AVX2";
+#else
+    char const *kernel = "scalar fallback";
+#endif
+
+    std::cout << totbases << " nucleotides, read length " << readlen << "\n";
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "    scalar loop:  " << (totbases / 1048576.0) / tscalar << " Mbs/second\n";
+    std::cout << "    encode (" << kernel << "): " << (totbases / 1048576.0) / tvector << " Mbs/second\n";
+    std::cout << "    speedup: " << tscalar / tvector << "x, output " << (same? "identical" : "MISMATCH") << std::endl;
+
+    return same? 0 : 1;
+}
@@ -3,6 +3,7 @@
 
 #include <limits>
 #include <cstdint>
+#include <type_traits>
 
 #ifndef KMER_SIZE
 #error "KMER_SIZE must be defined"
@@ -19,10 +20,31 @@ static_assert(0 < SMER_SIZE && SMER_SIZE <= KMER_SIZE);
 #error "UPPER_KMER_FREQ must be defined"
 #else
 static_assert(0 < LOWER_KMER_FREQ && LOWER_KMER_FREQ <= UPPER_KMER_FREQ && UPPER_KMER_FREQ <= std::numeric_limits<uint16_t>::max());
+
+/*
+ * Smallest counter that still tells counts above UPPER_KMER_FREQ apart, for
+ * counters that saturate.
+ */
+typedef std::conditional<(UPPER_KMER_FREQ < 255), uint8_t,
+        std::conditional<(UPPER_KMER_FREQ < 65535), uint16_t, uint32_t>::type>::type KmerCounter;
+#endif
+
+/*
+ * Up to this k-mer size, k-mers are counted in one array of 4^KMER_SIZE
+ * counters indexed by the k-mer bits instead of being sorted.
+ */
+#ifndef DENSE_KMER_SIZE
+#define DENSE_KMER_SIZE 15
 #endif
+static_assert(DENSE_KMER_SIZE <= 16);
 
-typedef int32_t MPI_Count_t;
-typedef int32_t MPI_Offset_t;
-#define MPI_COUNT_TYPE MPI_INT
+/*
+ * Read counts and displacements. These are 64-bit so that read sets with more
+ * than 2^31 reads work; MPI calls that only take int counts go through the
+ * chunked helpers in fileio.cpp.
+ */
+typedef int64_t MPI_Count_t;
+typedef int64_t MPI_Offset_t;
+#define MPI_COUNT_TYPE MPI_INT64_T
 
 #endif
@@ -16,6 +16,8 @@ public:
     DnaBuffer(size_t bufsize, size_t numreads, uint8_t *buf, const size_t *readlens);
 
     void push_back(char const *s, size_t len);
+    void fill(size_t i, char const *s);
+    void fill(size_t i, char const *s, size_t linelen, size_t col = 0);
     size_t size() const { return sequences.size(); }
     size_t getbufsize() const { return bufsize; }
     size_t getrangebufsize(size_t start, size_t count) const;
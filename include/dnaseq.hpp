@@ -39,8 +39,8 @@ public:
     DnaSeq(size_t len, uint8_t *mem) : len(len), memory(mem) {}
 
     /*
-     * char const *s - ASCII DNA sequence. Can include lower case letters. Ns converted to As.
-     *                 Non-nucleotide characters cause undefined behaviour.
+     * char const *s - ASCII DNA sequence. Can include lower case letters. Ns (and any other
+     *                 non-nucleotide characters, e.g. IUPAC codes) converted to As.
      * size_t len    - sequence length (number of nucleotides)
      * uint8_t* mem  - pointer to where compressed sequence should be written to and stored.
      */
@@ -118,11 +118,63 @@ public:
      */
     int revcomp_at(size_t i) const { return 3 - (*this)[len-1-i]; }
 
+    /*
+     * Calls @f(code) for every nucleotide in order, same codes as operator[].
+     * The packed sequence is read a 64-bit word (32 nucleotides) at a time and
+     * nothing past its last byte is touched, so it is safe on receive buffers.
+     */
+    template <typename F>
+    void foreachcode(F&& f) const
+    {
+        size_t nbytes = numbytes();
+        size_t b = 0;
+
+        for (; b + 8 <= nbytes; b += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, memory + b, 8);
+            word = __builtin_bswap64(word);
+
+            size_t n = len - 4*b < 32? len - 4*b : 32;
+
+            for (size_t j = 0; j < n; ++j, word <<= 2)
+                f(static_cast<int>(word >> 62));
+        }
+
+        for (; b < nbytes; ++b)
+        {
+            uint8_t byte = memory[b];
+            size_t n = len - 4*b < 4? len - 4*b : 4;
+
+            for (size_t j = 0; j < n; ++j, byte <<= 2)
+                f(static_cast<int>(byte >> 6));
+        }
+    }
+
     /*
      * Returns the number of bytes needed to encode a given number of nucleotides.
      */
     static size_t bytesneeded(size_t n) { return (n+3)/4; }
 
+    /*
+     * 2-bit encodes @n ASCII nucleotides starting at @s into @mem, 4 nucleotides
+     * per byte with the first one in the most significant bits (the layout
+     * operator[] expects). Writes exactly bytesneeded(n) bytes; unused bits of
+     * the last byte are zero. Anything but A, C, G and T (either case) is
+     * encoded as A. @encode uses the AVX2 kernel when compiled with -mavx2
+     * and otherwise falls back to @encode_scalar.
+     */
+    static void encode(char const *s, size_t n, uint8_t *mem);
+    static void encode_scalar(char const *s, size_t n, uint8_t *mem);
+
+    /*
+     * Same as @encode, except the nucleotides are written to positions
+     * [offset..offset+n) of the 2-bit sequence starting at @mem. Positions
+     * before @offset that share a byte with it must already be encoded.
+     * Used to encode line-wrapped sequences one line at a time.
+     */
+    static void encode_at(char const *s, size_t n, uint8_t *mem, size_t offset);
+
     /*
      * getcodechar : [0,1,2,3,4] -> [A,C,G,T,X]
      * getcharcode : [A,a,C,c,G,g,T,t,N,n,...] -> [0,0,1,1,2,2,3,3,0,0,X]
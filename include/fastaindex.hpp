@@ -8,45 +8,72 @@
 class FastaIndex
 {
 public:
-    typedef struct { size_t len, pos, bases; } Record;
+    /*
+     * As in a .fai: sequence length, offset of the first base, and bases per
+     * line; plus the file. Pieces of split records (see @getpartition) also
+     * have the column of their first base within its line, and the number of
+     * their last bases that the next piece starts with; both are 0 otherwise.
+     */
+    typedef struct { size_t len, pos, bases, fileid, col, overlap; } Record;
 
-    FastaIndex(const std::string& fasta_fname, MPI_Comm comm);
+    /*
+     * How @getmydna gets at the raw FASTA contents. MPIIO (default) reads each
+     * processor's chunk with collective MPI-IO, which is what parallel filesystems
+     * want. MMAP maps the chunk into memory and parses it in place, which avoids
+     * holding a second, anonymous copy of it when the FASTA is on node-local
+     * storage or already in the page cache.
+     */
+    enum InputMode { MPIIO = 0, MMAP = 1 };
+
+    /*
+     * Several FASTA files are indexed and partitioned as if they were
+     * concatenated in the given order. Read ids are global over all files.
+     */
+    FastaIndex(const std::vector<std::string>& fasta_fnames, MPI_Comm comm, bool writefai = false);
+    FastaIndex(const std::string& fasta_fname, MPI_Comm comm, bool writefai = false) : FastaIndex(std::vector<std::string>{fasta_fname}, comm, writefai) {}
 
     MPI_Comm getcomm() const { return comm; }
-    std::string get_fasta_fname() const { return fasta_fname; }
-    std::string get_faidx_fname() const { return fasta_fname + ".fai"; }
+    int getnumfiles() const { return static_cast<int>(fasta_fnames.size()); }
+    std::string get_fasta_fname(int fileid = 0) const { return fasta_fnames[fileid]; }
+    std::string get_faidx_fname(int fileid = 0) const { return fasta_fnames[fileid] + ".fai"; }
 
     size_t gettotrecords() const { return readdispls.back(); }
     size_t getreadcount(size_t i) const { return static_cast<size_t>(readcounts[i]); }
     size_t getreaddispl(size_t i) const { return static_cast<size_t>(readdispls[i]); }
     size_t getmyreadcount() const { int t; MPI_Comm_rank(comm, &t); return getreadcount(t); }
-    size_t getmyreaddispl() const { int t; MPI_Comm_size(comm, &t); return getreaddispl(t); }
+    size_t getmyreaddispl() const { int t; MPI_Comm_rank(comm, &t); return getreaddispl(t); }
     int getreadowner(size_t i) const;
 
     std::vector<size_t> getmyreadlens() const;
+    std::vector<size_t> getmyoverlaps() const; /* Record::overlap of my reads */
 
     const std::vector<Record>& getmyrecords() const { return myrecords; }
     const std::vector<MPI_Count_t> getreadcounts() const { return readcounts; }
     const std::vector<MPI_Offset_t> getreaddispls() const { return readdispls; }
 
-    DnaBuffer getmydna() const;
+    DnaBuffer getmydna(InputMode mode = MPIIO) const;
     void log(const DnaBuffer& buffer) const;
 
-    static Record get_faidx_record(const std::string& line, std::string& name);
-
-    std::vector<std::string> bcastnames();
+    /*
+     * Names of my reads, in order. Names aren't held in memory; they are read
+     * from the FASTA header lines on each call, so this is collective.
+     */
+    std::vector<std::string> getmyreadnames() const;
 
 private:
     MPI_Comm comm;
     std::vector<Record> myrecords; /* records for the reads local processor is responsible for */
-    std::vector<Record> rootrecords; /* records for all the reads across all processors (parsed by root rank in constructor) */
     std::vector<MPI_Count_t> readcounts; /* number of reads assigned to each processor. Each processor gets a copy. |readcounts| == nprocs */
     std::vector<MPI_Offset_t> readdispls; /* displacement counts for reads across all processors. Each processor gets a copy. |readdispls| == nprocs+1 */
-    std::string fasta_fname; /* FASTA file name */
-    std::vector<std::string> rootnames;
+    std::vector<std::string> fasta_fnames; /* FASTA file names */
     int nprocs, myrank;
 
-    void getpartition(std::vector<MPI_Count_t>& sendcounts);
+    void getpartition(std::vector<Record>& records, std::vector<MPI_Count_t>& sendcounts) const; /* may split long records into overlapping pieces */
+
+    std::vector<Record> readfaidx(int fileid); /* every processor parses a share of "{fasta_fname}.fai" */
+    std::vector<Record> buildfaidx(int fileid, bool writefai); /* no .fai: every processor indexes a share of the FASTA */
+    void writefaidx(int fileid, const std::vector<Record>& records, const std::vector<std::string>& names) const;
+    void distribute(std::vector<Record>& records);
 };
 
 #endif
\ No newline at end of file
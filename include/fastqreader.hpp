@@ -0,0 +1,54 @@
+#ifndef FASTQ_READER_H_
+#define FASTQ_READER_H_
+
+#include <mpi.h>
+#include "dnabuffer.hpp"
+#include "compiletime.h"
+
+/*
+ * FASTQ counterpart of FastaIndex. There is no index: every processor takes
+ * an equal byte share of the file and is responsible for the records whose
+ * '@' header line starts inside its share. Records must be in the usual four
+ * line layout (header, sequence, '+' line, qualities).
+ */
+class FastqReader
+{
+public:
+    /*
+     * Several FASTQ files are read as if they were concatenated
+     * in the given order. Read ids are global over all files.
+     */
+    FastqReader(const std::vector<std::string>& fastq_fnames, MPI_Comm comm);
+
+    MPI_Comm getcomm() const { return comm; }
+    int getnumfiles() const { return static_cast<int>(fastq_fnames.size()); }
+    std::string get_fastq_fname(int fileid = 0) const { return fastq_fnames[fileid]; }
+
+    /*
+     * Read counts and displacements are only known after @getmydna.
+     */
+    size_t gettotrecords() const { return readdispls.back(); }
+    size_t getreadcount(size_t i) const { return static_cast<size_t>(readcounts[i]); }
+    size_t getreaddispl(size_t i) const { return static_cast<size_t>(readdispls[i]); }
+    size_t getmyreadcount() const { return getreadcount(myrank); }
+    size_t getmyreaddispl() const { return getreaddispl(myrank); }
+
+    DnaBuffer getmydna();
+
+    /*
+     * Whether @fname looks like FASTQ, i.e. its first character is '@'.
+     * Only the root reads the file, everyone gets the answer.
+     */
+    static bool isfastq(const std::string& fname, MPI_Comm comm);
+
+private:
+    MPI_Comm comm;
+    std::vector<std::string> fastq_fnames; /* FASTQ file names */
+    std::vector<MPI_Count_t> readcounts; /* number of reads assigned to each processor. |readcounts| == nprocs */
+    std::vector<MPI_Offset_t> readdispls; /* displacement counts for reads across all processors. |readdispls| == nprocs+1 */
+    int nprocs, myrank;
+
+    void readshare(int fileid, MPI_Offset mystart, MPI_Offset myend, std::string& contents, std::vector<std::pair<size_t, size_t>>& records) const;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef FILE_IO_H_
+#define FILE_IO_H_
+
+#include <mpi.h>
+#include <cstddef>
+#include <vector>
+#include "compiletime.h"
+
+/*
+ * Largest element count handed to a single MPI call. MPI-3.1 has no
+ * large-count variants, so bigger transfers are split up.
+ */
+const size_t max_mpi_count = 1 << 30;
+
+/*
+ * Independent read of @count bytes at @pos, split up so that
+ * each MPI call stays within the range of an int count.
+ */
+void read_at_chunked(MPI_File fh, MPI_Offset pos, char *buf, size_t count);
+
+/*
+ * Collective versions of the above. Every processor has to make the same
+ * number of calls, so the number of rounds is agreed on first and processors
+ * that are done participate with empty reads/writes.
+ */
+void read_at_all_chunked(MPI_File fh, MPI_Offset pos, char *buf, size_t count, MPI_Comm comm);
+void write_at_all_chunked(MPI_File fh, MPI_Offset pos, char const *buf, size_t count, MPI_Comm comm);
+
+/*
+ * MPI_Alltoallv with 64-bit counts and displacements (in units of @dtype).
+ * When everything fits in an int this is a plain MPI_Alltoallv, otherwise
+ * the exchange is done with nonblocking point-to-point messages of at most
+ * @max_mpi_count elements each.
+ */
+void alltoallv_large(const void *sendbuf, const std::vector<MPI_Count_t>& sendcounts, const std::vector<MPI_Offset_t>& sdispls,
+                     void *recvbuf, const std::vector<MPI_Count_t>& recvcounts, const std::vector<MPI_Offset_t>& rdispls,
+                     MPI_Datatype dtype, MPI_Comm comm);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef GZIP_READER_H_
+#define GZIP_READER_H_
+
+#include <mpi.h>
+#include "dnabuffer.hpp"
+#include "compiletime.h"
+
+/*
+ * Reader for gzip compressed FASTA or FASTQ. BGZF files (what bgzip writes:
+ * a series of independent gzip blocks of at most 64 KB, each recording its
+ * own size) are inflated in parallel: every processor takes the blocks that
+ * start in its equal byte share of the file and its threads inflate them
+ * concurrently. Plain gzip has no such structure, so the root inflates it
+ * on its own. Either way, the uncompressed stream is then redistributed so
+ * that every processor holds whole records, which are parsed and 2-bit
+ * encoded in memory.
+ */
+class GzipReader
+{
+public:
+    /*
+     * Several files are read as if they were concatenated in the given
+     * order. Read ids are global over all files.
+     */
+    GzipReader(const std::vector<std::string>& gz_fnames, MPI_Comm comm);
+
+    MPI_Comm getcomm() const { return comm; }
+    int getnumfiles() const { return static_cast<int>(gz_fnames.size()); }
+    std::string get_gz_fname(int fileid = 0) const { return gz_fnames[fileid]; }
+    bool isbgzf(int fileid = 0) const { return bgzf[fileid]; }
+
+    /*
+     * Read counts and displacements are only known after @getmydna.
+     */
+    size_t gettotrecords() const { return readdispls.back(); }
+    size_t getreadcount(size_t i) const { return static_cast<size_t>(readcounts[i]); }
+    size_t getreaddispl(size_t i) const { return static_cast<size_t>(readdispls[i]); }
+    size_t getmyreadcount() const { return getreadcount(myrank); }
+    size_t getmyreaddispl() const { return getreaddispl(myrank); }
+
+    DnaBuffer getmydna();
+
+    /*
+     * Whether @fname starts with the gzip magic bytes. Only the root
+     * reads the file, everyone gets the answer.
+     */
+    static bool isgzip(const std::string& fname, MPI_Comm comm);
+
+private:
+    MPI_Comm comm;
+    std::vector<std::string> gz_fnames; /* gzip compressed FASTA or FASTQ file names */
+    std::vector<MPI_Count_t> readcounts; /* number of reads assigned to each processor. |readcounts| == nprocs */
+    std::vector<MPI_Offset_t> readdispls; /* displacement counts for reads across all processors. |readdispls| == nprocs+1 */
+    std::vector<int> bgzf; /* whether each file is BGZF or plain gzip */
+    std::vector<long long> filesizes;
+    int nprocs, myrank;
+
+    std::string inflatebgzf(int fileid, MPI_Offset mystart, MPI_Offset myend) const; /* my blocks, inflated: a contiguous piece of the uncompressed stream */
+    std::string inflategzip(int fileid, int root) const; /* root gets the whole uncompressed stream, everyone else nothing */
+    std::string gatherrecords(const std::string& stream, bool& fastq) const;
+};
+
+#endif
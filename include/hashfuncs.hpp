@@ -7,6 +7,21 @@
 void wanghash64(const void *key, void *hashval);
 void wanghash64_inv(const void *hashval, void *key);
 
+/*
+ * Same as above, inlined for hot loops.
+ */
+inline uint64_t wanghash64(uint64_t key)
+{
+    key = (~key) + (key << 21);
+    key = key ^ (key >> 24);
+    key = (key + (key << 3)) + (key << 8);
+    key = key ^ (key >> 14);
+    key = (key + (key << 2)) + (key << 4);
+    key = key ^ (key >> 28);
+    key = key + (key << 31);
+    return key;
+}
+
 void murmurhash3_128(const void *key, uint32_t numbytes, void *out);
 void murmurhash3_64(const void *key, uint32_t numbytes, void *out);
 void murmurhash3_32(const void *key, uint32_t numbytes, void *out);
@@ -57,6 +57,15 @@ public:
     static std::vector<Kmer> GetKmers(const DnaSeq& s);
     static std::vector<Kmer> GetRepKmers(const DnaSeq& s);
 
+    /*
+     * Calls @f(i, rep) for the representative of every k-mer of @s, in order,
+     * where i is the k-mer's position in @s. Same k-mers as GetRepKmers, but
+     * nothing is allocated and no twin is built from scratch: the k-mer and its
+     * reverse complement are each rolled along by one base per step.
+     */
+    template <typename F>
+    static void ForEachRepKmer(const DnaSeq& s, F&& f);
+
     template <int N>
     friend std::ostream& operator<<(std::ostream& os, const Kmer<N>& kmer);
 
@@ -251,7 +260,7 @@ Kmer<NLONGS> Kmer<NLONGS>::GetExtension(int code) const
         ext.longs[i] = longs[i] << 2;
     }
 
-    ext.longs[NLONGS-1] |= (static_cast<uint64_t>(code) << (2 * (32 - (KMER_SIZE%32))));
+    ext.longs[NLONGS-1] |= (static_cast<uint64_t>(code) << (2 * ((32 - (KMER_SIZE%32)) % 32)));
 
     return ext;
 }
@@ -333,6 +342,45 @@ std::vector<Kmer<NLONGS>> Kmer<NLONGS>::GetRepKmers(const DnaSeq& s)
     return kmers;
 }
 
+template <int NLONGS>
+template <typename F>
+void Kmer<NLONGS>::ForEachRepKmer(const DnaSeq& s, F&& f)
+{
+    int num_kmers = static_cast<int>(s.size()) - KMER_SIZE + 1;
+
+    if (num_kmers <= 0) return;
+
+    /*
+     * The last base of a k-mer sits in longs[last] at bit @lastshift; a
+     * base enters the forward k-mer there and its complement enters the
+     * twin at the top of longs[0]. Everything below @lastshift stays zero.
+     */
+    constexpr int last = (KMER_SIZE - 1) / 32;
+    constexpr int lastshift = 2 * (31 - ((KMER_SIZE - 1) % 32));
+    constexpr uint64_t lastmask = ~((1ULL << lastshift) - 1);
+
+    Kmer fwd, rev;
+
+    int i = 0;
+
+    s.foreachcode([&](int c)
+    {
+        uint64_t code = static_cast<uint64_t>(c);
+
+        for (int l = 0; l < last; ++l)
+            fwd.longs[l] = (fwd.longs[l] << 2) | (fwd.longs[l+1] >> 62);
+        fwd.longs[last] = (fwd.longs[last] << 2) | (code << lastshift);
+
+        for (int l = last; l > 0; --l)
+            rev.longs[l] = (rev.longs[l] >> 2) | (rev.longs[l-1] << 62);
+        rev.longs[0] = (rev.longs[0] >> 2) | ((3 - code) << 62);
+        rev.longs[last] &= lastmask;
+
+        if (i >= KMER_SIZE - 1)
+            f(i - KMER_SIZE + 1, rev < fwd? rev : fwd);
+        ++i;
+    });
+}
 
 using TKmer = typename std::conditional<(KMER_SIZE <= 32), Kmer<1>,
               typename std::conditional<(KMER_SIZE <= 64), Kmer<2>,
@@ -0,0 +1,91 @@
+#ifndef KMER_FILTER_H_
+#define KMER_FILTER_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Bloom filters, one per task, that keep k-mers occurring only once out of
+ * the receive buckets. The same supermers are exchanged twice: during the
+ * first exchange every received k-mer is @mark'ed, which sets it in the
+ * task's "seen" filter, and also in its "repeated" filter if it was seen
+ * already. During the second exchange only k-mers that are @repeated go into
+ * the buckets, every occurrence of them, so their counts are exact. The few
+ * singletons that get through as false positives are dropped later by the
+ * LOWER_KMER_FREQ filter, as before.
+ *
+ * All bits of a k-mer lie within one 64-bit word, so marking it is a single
+ * atomic or, which also tells whether all of them were set before. Senders
+ * are received in parallel, so of two threads marking the same k-mer, one
+ * always sees the other's bits.
+ *
+ * Elements are known by their hash only. Tasks are identified by their local
+ * index on this processor.
+ */
+class KmerFilter
+{
+public:
+    /* filter bits per received k-mer, in each of the two filters */
+    static constexpr size_t BITS_PER_KMER = 8;
+
+    KmerFilter() : planned(false), keeping(false) {}
+
+    /*
+     * @taskcnts[i] is the number of k-mers task i receives. Only the first
+     * call after construction or @reset allocates, later ones keep the filters.
+     */
+    void plan(const std::vector<size_t>& taskcnts);
+
+    /* during the first exchange */
+    bool marking() const { return planned && !keeping; }
+
+    /* switch to the second exchange */
+    void keep() { keeping = true; }
+
+    inline void mark(size_t task, uint64_t hash)
+    {
+        uint64_t& word = seen[task][hash & wordmask[task]];
+        uint64_t bits = mask(hash);
+        uint64_t old;
+
+        #pragma omp atomic capture
+        { old = word; word |= bits; }
+
+        if ((old & bits) == bits)
+        {
+            uint64_t& again = repeats[task][hash & wordmask[task]];
+            #pragma omp atomic update
+            again |= bits;
+        }
+    }
+
+    inline bool repeated(size_t task, uint64_t hash) const
+    {
+        uint64_t bits = mask(hash);
+        return (repeats[task][hash & wordmask[task]] & bits) == bits;
+    }
+
+    /* free the filters and forget the plan */
+    void reset();
+
+    size_t bytes() const;
+
+private:
+    bool planned;
+    bool keeping;
+    std::vector<std::vector<uint64_t>> seen;
+    std::vector<std::vector<uint64_t>> repeats;
+    std::vector<uint64_t> wordmask;
+
+    /*
+     * The low bits of the hash pick the word, four 6-bit fields from the
+     * top pick the bits within it.
+     */
+    static inline uint64_t mask(uint64_t hash)
+    {
+        return (1ULL << (hash >> 58)) | (1ULL << ((hash >> 52) & 63)) | (1ULL << ((hash >> 46) & 63)) | (1ULL << ((hash >> 40) & 63));
+    }
+};
+
+#endif
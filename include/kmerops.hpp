@@ -13,6 +13,9 @@
 #include "compiletime.h"
 
 #include "supermer.hpp"
+#include "kmerspill.hpp"
+#include "kmerfilter.hpp"
+#include "kmersketch.hpp"
 
 #define DISPATCH_UPPER_COE 2.0
 #define DISPATCH_STEP 0.05
@@ -75,13 +78,28 @@ struct KmerSeedStruct{
 };
 
 typedef std::vector<std::vector<KmerSeedStruct>> KmerSeedBuckets;
+
+/*
+ * Mixes all words of a k-mer. k-mers of one task share their minimizer, so
+ * some of their bits are always the same, which the mixing hides.
+ */
+inline uint64_t hash_kmer(const TKmer& kmer) {
+    uint64_t words[TKmer::NBYTES / 8];
+    std::memcpy(words, kmer.GetBytes(), TKmer::NBYTES);
+    uint64_t h = 0;
+    for (int i = 0; i < TKmer::NBYTES / 8; i++) {
+        h = wanghash64(h ^ words[i]);
+    }
+    return h;
+}
 typedef std::vector<std::vector<std::vector<KmerSeedStruct>>> KmerSeedVecs;
 
 std::unique_ptr<KmerListS>
 filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, 
      std::unique_ptr<KmerListSVec>& recv_kmerlists,
      TaskDispatcher& dispatcher,
-     int thr_per_worker = THREAD_PER_WORKER);
+     int thr_per_worker = THREAD_PER_WORKER,
+     KmerSpill* spill = nullptr);
 
 int GetKmerOwner(const TKmer& kmer, int nprocs);
 
@@ -103,32 +121,47 @@ void count_sorted_task(std::vector<KmerSeedStruct>& kmerseeds, KmerListS& kmerli
 
 void count_sorted_kmerlist(KmerListS& kmers, KmerListS& kmerlist, size_t start_pos, size_t seedcnt, size_t& valid_kmer, bool filter=true);
 
-void print_kmer_histogram(const KmerListS& kmerlist, MPI_Comm comm);
+/*
+ * Counts a task in a hash table instead of sorting it, in one pass over its
+ * k-mers. @expected is the number of distinct k-mers the table is sized for;
+ * it grows if there are more.
+ */
+void count_hashed_task(const std::vector<KmerSeedStruct>& kmerseeds, KmerListS& kmerlist, size_t seedcnt, size_t expected, size_t& valid_kmer);
 
-class ParallelData{
-private:
+/*
+ * Estimates the ratio of distinct k-mers to k-mers from (some of) @tasks,
+ * or returns a negative value if they hold no k-mers to sample.
+ */
+double estimate_distinct_ratio(const KmerSeedBuckets& kmerseeds, const std::vector<int>& tasks);
 
-    std::vector<std::vector<std::vector<int>>> destinations;
-    std::vector<std::vector<uint64_t>> readids;
+/*
+ * 1: sort and scan, 2: hash tables, see COUNT.
+ */
+int count_decision(double distinct_ratio, int sort, Logger& logger);
 
+void print_kmer_histogram(const KmerListS& kmerlist, MPI_Comm comm);
+
+class ParallelData{
 public:
     int nprocs;
     int ntasks;
     int nthr_membounded;
+    int max_supermer_len;
+    size_t supermer_cnt = 0;            /* supermers encoded */
+    size_t default_supermer_cnt = 0;    /* supermers there would be with MAX_SUPERMER_LEN */
     std::vector<int> task_type;
     std::vector<std::vector<std::vector<uint32_t>>> lengths;
     std::vector<std::vector<std::vector<uint8_t>>> supermers;
     std::vector<KmerListS> kmerlists;
     
 
-    ParallelData(int nprocs, int ntasks, int nthr_membounded) {
+    ParallelData(int nprocs, int ntasks, int nthr_membounded, int max_supermer_len = MAX_SUPERMER_LEN) {
         this->nprocs = nprocs;
         this->ntasks = ntasks;
         this->nthr_membounded = nthr_membounded;
-        destinations.resize(nthr_membounded);
+        this->max_supermer_len = max_supermer_len;
         lengths.resize(nthr_membounded);
         supermers.resize(nthr_membounded);
-        readids.resize(nthr_membounded);
         kmerlists.resize(nprocs * ntasks);
 
         for (int i = 0; i < nthr_membounded; i++) {
@@ -173,11 +206,9 @@ public:
                             size_t len_bytes = cnt_bytes(len);
                             auto seq = DnaSeq(len, supermers[i][task].data() + idx);
 
-                            auto repmers = TKmer::GetRepKmers(seq);
-
-                            for (int k = 0; k < len - KMER_SIZE + 1; k++) {
-                                kmerseeds.emplace_back(repmers[k]);
-                            }
+                            TKmer::ForEachRepKmer(seq, [&](int k, const TKmer& repmer) {
+                                kmerseeds.emplace_back(repmer);
+                            });
                             idx += len_bytes;
                         }
                         lengths[i][task].clear();
@@ -206,14 +237,28 @@ public:
         }
     }
 
-    std::vector<std::vector<int>>& get_my_destinations(int tid) {
-        return destinations[tid];
+    /* get ready for the next chunk of reads, keeping the supermer buffers allocated */
+    void clear() {
+        supermer_cnt = 0;
+        default_supermer_cnt = 0;
+        for (int i = 0; i < nthr_membounded; i++) {
+            for (int j = 0; j < nprocs * ntasks; j++) {
+                lengths[i][j].clear();
+                supermers[i][j].clear();
+            }
+        }
+        for (auto& kmerlist : kmerlists) {
+            kmerlist.clear();
+        }
     }
 
-    std::vector<int>& register_new_destination (int tid, uint64_t readid) {
-        destinations[tid].push_back(std::vector<int>());
-        readids[tid].push_back(readid);
-        return destinations[tid].back();
+    /* free everything held for a task once it has been sent */
+    void release_task(size_t taskid) {
+        for (int i = 0; i < nthr_membounded; i++) {
+            std::vector<uint32_t>().swap(lengths[i][taskid]);
+            std::vector<uint8_t>().swap(supermers[i][taskid]);
+        }
+        KmerListS().swap(kmerlists[taskid]);
     }
 
     std::vector<std::vector<uint32_t>>& get_my_lengths(int tid) {
@@ -224,10 +269,6 @@ public:
         return supermers[tid];
     }
 
-    std::vector<uint64_t>& get_my_readids(int tid) {
-        return readids[tid];
-    }
-
     size_t get_supermer_cnt(int global_taskid) {
         size_t cnt = 0;
         for (int i = 0; i < nthr_membounded; i++) {
@@ -280,6 +321,36 @@ public:
         return task_type;
     }
 
+    /* number of k-mers of each task, known everywhere after balanced_dispatch */
+    const std::vector<size_t>& get_tasksz() const {
+        return tasksz;
+    }
+
+    /*
+     * The dispatch restricted to pass @pass out of @npasses: every processor's
+     * task list is cut into @npasses consecutive groups of about the same
+     * number of k-mers, and only group @pass of each is kept.
+     */
+    TaskDispatcher get_pass(size_t pass, size_t npasses) const {
+        TaskDispatcher sub(*this);
+        for (size_t i = 0; i < nprocs; i++) {
+            size_t total = 0, before = 0;
+            for (size_t id : taskid[i]) {
+                total += tasksz[id];
+            }
+            sub.taskid[i].clear();
+            for (size_t id : taskid[i]) {
+                double midpoint = before + tasksz[id] / 2.0;
+                size_t p = total ? std::min(npasses - 1, static_cast<size_t>(midpoint * npasses / total)) : 0;
+                if (p == pass) {
+                    sub.taskid[i].push_back(id);
+                }
+                before += tasksz[id];
+            }
+        }
+        return sub;
+    }
+
     std::vector<int> get_unbalanced_taskidx(int procid){
         auto taskid = get_taskid(procid);
         std::vector<int> unbalanced_taskidx;
@@ -451,6 +522,7 @@ public:
         MPI_Barrier(comm);
         MPI_Bcast(task_dest.data(), global_tasks, MPI_UNSIGNED_LONG, 0, comm);
         MPI_Bcast(task_type.data(), global_tasks, MPI_INT, 0, comm);
+        MPI_Bcast(tasksz.data(), global_tasks, MPI_UNSIGNED_LONG, 0, comm);
         
         for (int i = 0; i < global_tasks; i++){
             taskid[task_dest[i]].push_back(i);
@@ -460,17 +532,34 @@ public:
 
 
 
+int get_task_count(int thr_per_worker = THREAD_PER_WORKER);
+
 ParallelData
 prepare_supermer(const DnaBuffer& myreads,
      MPI_Comm comm,
      int thr_per_worker = THREAD_PER_WORKER,
-     int max_thr_membounded = MAX_THREAD_MEMORY_BOUNDED);
-
+     int max_thr_membounded = MAX_THREAD_MEMORY_BOUNDED,
+     int max_supermer_len = MAX_SUPERMER_LEN);
+
+/*
+ * Turns the destinations of a read's k-mers, fed in order with @add, into
+ * supermers: a supermer is emitted as soon as the destination changes (or it
+ * reaches max_supermer_len), so destinations are never stored.
+ */
 struct SupermerEncoder{
     std::vector<std::vector<uint32_t>>& lengths;
     std::vector<std::vector<uint8_t>>& supermers;
     int max_supermer_len;
 
+    const DnaSeq* read = nullptr;
+    uint32_t start_pos = 0;     /* first k-mer of the current supermer */
+    int cnt = 0;                /* number of k-mers in the current supermer */
+    int last_dst = -1;
+    size_t runlen = 0;          /* number of k-mers since the destination last changed */
+
+    size_t supermer_cnt = 0;
+    size_t default_supermer_cnt = 0;
+
     SupermerEncoder(std::vector<std::vector<uint32_t>>& lengths, 
             std::vector<std::vector<uint8_t>>& supermers, 
             int max_supermer_len) : 
@@ -480,49 +569,94 @@ struct SupermerEncoder{
     // std::vector<bool> is depreciated, std::deque<bool> does not guarantee contiguity
     // std::bitset has a fixed length, so we use std::vector<uint8_t> instead
     // maybe we should skip this part and use a bitset for sendbuf directly
-    void copy_bits(std::vector<uint8_t>& dst, const uint8_t* src, uint64_t start_pos, int len){
+    /*
+     * Appends bases [@start_pos, @start_pos + @len) of the packed sequence @src
+     * (@srcbytes bytes long) to @dst, packed the same way from a byte boundary.
+     * Packed bases read as one big-endian bit string, so 8 bytes at a time are
+     * loaded as a word, shifted into alignment with the bits of the following
+     * byte funnelled in, and stored whole. Nothing past @srcbytes is read, and
+     * the bits after the last base are left zero.
+     */
+    void copy_bits(std::vector<uint8_t>& dst, const uint8_t* src, size_t srcbytes, uint64_t start_pos, int len){
 
         size_t start = dst.size();
-        dst.resize(start + cnt_bytes(len));
+        size_t nbytes = cnt_bytes(len);
+        dst.resize(start + nbytes);
+
+        uint8_t* out = dst.data() + start;
+        const uint8_t* in = src + start_pos / 4;
+        size_t avail = srcbytes - start_pos / 4;
+        int shift = 2 * (start_pos % 4);
+        size_t j = 0;
 
-        for (int i = 0; i < len; i++) {
-            /* the order is confusing, just make sure we keep it consistent*/
-            int loc = i + start_pos;
-            bool first_bit = (src[loc / 4] >> (7 - 2*(loc%4))) & 1;
-            bool second_bit = (src[loc / 4] >> (6 - 2*(loc%4))) & 1;
-            dst[start + i/4] |= (first_bit << (7 - (i%4)*2)) | (second_bit << (6 - (i%4)*2));
+        for (; j + 8 <= nbytes && j + 9 <= avail; j += 8) {
+            uint64_t word;
+            std::memcpy(&word, in + j, 8);
+            word = __builtin_bswap64(word);
+            if (shift) {
+                word = (word << shift) | (in[j + 8] >> (8 - shift));
+            }
+            word = __builtin_bswap64(word);
+            std::memcpy(out + j, &word, 8);
         }
 
+        for (; j < nbytes; j++) {
+            uint8_t byte = in[j] << shift;
+            if (shift && j + 1 < avail) {
+                byte |= in[j + 1] >> (8 - shift);
+            }
+            out[j] = byte;
+        }
+
+        if (len % 4) {
+            out[nbytes - 1] &= static_cast<uint8_t>(0xff << (8 - 2 * (len % 4)));
+        }
     }
 
 
-    void encode(const std::vector<int>& dest, const DnaSeq& read){
-        
-        if (read.size() < KMER_SIZE) return;
-
-        /* initial conditions */
-        uint32_t start_pos = 0;
-        int cnt = 1;
-        int last_dst = dest[0];
-
-        for (int i = 1; i <= dest.size(); i++) {
-
-            if(i == dest.size() || dest[i] != last_dst || cnt == max_supermer_len - KMER_SIZE + 1) {
-                /* encode the supermer */
-                size_t len = cnt + KMER_SIZE - 1;
-                lengths[last_dst].push_back(len);
-                copy_bits(supermers[last_dst], read.data(), start_pos, len);
-
-                /* reset the counter */
-                
-                if (i < dest.size()) last_dst = dest[i];
-                cnt = 0;
-                start_pos = i;
-            }
+    void start(const DnaSeq& seq) {
+        read = &seq;
+        start_pos = 0;
+        cnt = 0;
+        runlen = 0;
+    }
 
-            /* increment the counter */
-            cnt++;
+    /* the next k-mer of the read goes to @dst */
+    void add(int dst) {
+        if (cnt > 0 && dst != last_dst) {
+            end_run();
+        }
+        if (cnt > 0 && (dst != last_dst || cnt == max_supermer_len - KMER_SIZE + 1)) {
+            emit();
+            start_pos += cnt;
+            cnt = 0;
         }
+        last_dst = dst;
+        cnt++;
+        runlen++;
+    }
+
+    /* emit the last supermer of the read */
+    void finish() {
+        if (cnt > 0) {
+            end_run();
+            emit();
+        }
+        cnt = 0;
+    }
+
+    void emit() {
+        size_t len = cnt + KMER_SIZE - 1;
+        lengths[last_dst].push_back(len);
+        copy_bits(supermers[last_dst], read->data(), read->numbytes(), start_pos, len);
+        supermer_cnt++;
+    }
+
+    /* a run of k-mers with the same destination ends: count what the default length would cut it into */
+    void end_run() {
+        constexpr size_t default_kmers = MAX_SUPERMER_LEN - KMER_SIZE + 1;
+        default_supermer_cnt += (runlen + default_kmers - 1) / default_kmers;
+        runlen = 0;
     }
 };
 
@@ -573,6 +707,18 @@ protected:
         }
     }
 
+    /* processors without tasks (possible when counting in passes) have nothing to send to or receive */
+    void skip_empty_tasklists(std::vector<size_t>& send_taskidx, std::vector<size_t>& recv_taskidx) {
+        for (int i = 0; i < nprocs; i++) {
+            if (dispatcher.get_taskid(i).empty()) {
+                send_taskidx[i] = -1;
+            }
+            if (mytasks == 0) {
+                recv_taskidx[i] = -1;
+            }
+        }
+    }
+
     bool check_complete(uint8_t* recvbuf) {
         bool flag = true;
         for (int i = 0; i < nprocs; i++) {
@@ -684,15 +830,17 @@ timer.stop_and_log("write_first_sendbuf");
     }
 
     BatchExchanger(MPI_Comm comm, size_t batch_size, size_t max_element_size, TaskDispatcher& dispatcher) : 
-        comm(comm), batch_size(batch_size), status(BATCH_NOT_INIT), 
-        max_element_size(max_element_size),
-        dispatcher(dispatcher)
+        comm(comm), dispatcher(dispatcher), batch_size(batch_size),
+        max_element_size(max_element_size), status(BATCH_NOT_INIT)
     {
         round = 0;
         MPI_Comm_size(comm, &nprocs);
         MPI_Comm_rank(comm, &myrank);
         mytasks = dispatcher.get_taskid(myrank).size();
-        send_limit = batch_size - sizeof(char) - max_element_size;
+
+        /* a batch always has room for a few of the largest elements (the same on every processor) */
+        this->batch_size = std::max(batch_size, 4 * max_element_size + sizeof(char));
+        send_limit = this->batch_size - sizeof(char) - max_element_size;
     };
 
     ~BatchExchanger()  
@@ -812,6 +960,7 @@ public:
 
             recv_idx.resize(nprocs, 0);
             recv_taskidx.resize(nprocs, 0);
+            skip_empty_tasklists(current_taskidx, recv_taskidx);
             recvbuf.resize(nprocs * mytasks);
             for (int i = 0; i < nprocs * mytasks; i++) {
                 recvbuf[i].resize(recv_cnt[i], 0);
@@ -825,16 +974,47 @@ struct BucketAssistant{
     int mytasks, nprocs;
     KmerSeedBuckets& bucket;
     std::vector<KmerListS>& kmerlists;
+    KmerSpill* spill;
+    KmerFilter* filter;
+    std::vector<std::vector<size_t>> kept;   /* per sender and task: k-mers let through by the filter */
+    KmerSketch* sketch;
+    std::vector<std::vector<KmerListS>> sketched;   /* per sender and task: k-mers of the last batch, for the sketch */
+    std::vector<std::vector<KmerSeedStruct>> staged;   /* per sender: k-mers of a spilled task not written yet */
+    std::vector<int> staged_task;
+    std::vector<size_t> staged_pos;
     std::vector<std::vector<size_t>> recv_base;
     std::vector<std::vector<size_t>> current_recv;
     std::vector<std::vector<size_t>> current_recv_list;
     std::vector<std::vector<size_t>> max_recv_list;
 
+    /*
+     * Received k-mers are appended to whatever @bucket and @kmerlists already
+     * hold, so that several exchanges (one per chunk of reads) can fill them.
+     * When a bucket has to grow, room for @growth times its new size is
+     * reserved, to avoid reallocating it on every exchange.
+     *
+     * With @spill, the tasks it picks (see KmerSpill::plan) get no bucket:
+     * their k-mers are staged per sender and written to scratch instead.
+     *
+     * With @filter, the first exchange only marks k-mers in it and the
+     * buckets stay untouched; the second keeps the repeated ones (see
+     * KmerFilter), and @compact closes the gaps they leave in the buckets.
+     * Spilled tasks are not filtered.
+     *
+     * With @sketch, nothing is stored at all: received k-mers (and counted
+     * lists) are staged per sender and passed to the sketch by
+     * @sketch_staged, which emits the k-mers within the frequency bounds
+     * into @kmerlists during the second exchange.
+     */
     BucketAssistant(int mytasks, int nprocs, std::vector<int> unbalanced_taskidx, KmerSeedBuckets& bucket, 
             std::vector<KmerListS>& kmerlists,
             std::vector<std::vector<uint32_t>>& lengths,
-            std::vector<size_t>& kmerlist_lengths) : 
-        mytasks(mytasks), nprocs(nprocs), bucket(bucket), kmerlists(kmerlists){
+            std::vector<size_t>& kmerlist_lengths,
+            double growth = 1.0,
+            KmerSpill* spill = nullptr,
+            KmerFilter* filter = nullptr,
+            KmerSketch* sketch = nullptr) : 
+        mytasks(mytasks), nprocs(nprocs), bucket(bucket), kmerlists(kmerlists), spill(spill), filter(filter), sketch(sketch){
 
         current_recv_list.resize(mytasks);
         kmerlists.resize(mytasks);
@@ -848,6 +1028,7 @@ struct BucketAssistant{
             //std::cout<<"Task "<<idx<<std::endl;
             current_recv_list[idx].resize(nprocs, 0);
             max_recv_list[idx].resize(nprocs, 0);
+            current_recv_list[idx][0] = kmerlists[idx].size();
             for(int j = 1; j < nprocs; j++) {
                 current_recv_list[idx][j] = kmerlist_lengths[unbalanced_task_cnt * (j-1) + i] + current_recv_list[idx][j-1];
             }
@@ -857,7 +1038,10 @@ struct BucketAssistant{
                 //std::cout<<"kmerlist_lengths["<<unbalanced_task_cnt * j + i<<"] = "<<kmerlist_lengths[unbalanced_task_cnt * j + i]<<std::endl;
             }
             //std::cout<<"Resizing to"<<max_recv_list[idx][nprocs - 1]<<std::endl;
-            kmerlists[idx].reserve(max_recv_list[idx][nprocs - 1] + 256 / TKmer::NBYTES);
+            if (sketch) {
+                continue;
+            }
+            reserve(kmerlists[idx], max_recv_list[idx][nprocs - 1] + 256 / TKmer::NBYTES, growth);
             kmerlists[idx].resize(max_recv_list[idx][nprocs - 1]);
             //std::cout<<"Task "<<idx<<" kmerlist size: "<<kmerlists[idx].size()<<std::endl;
         }
@@ -877,7 +1061,45 @@ struct BucketAssistant{
             }
         }
 
+        if (filter || sketch) {
+            std::vector<size_t> taskcnts(mytasks, 0);
+            for(int j = 0; j < mytasks; j++) {
+                for(int i = 0; i < nprocs; i++) {
+                    taskcnts[j] += recv_cnt[i][j];
+                }
+            }
+            if (filter) {
+                filter->plan(taskcnts);
+                kept.assign(nprocs, std::vector<size_t>(mytasks, 0));
+            } else {
+                /* counted lists are sketched too */
+                for (int idx : unbalanced_taskidx) {
+                    taskcnts[idx] += max_recv_list[idx][nprocs - 1] - current_recv_list[idx][0];
+                }
+                sketch->plan(taskcnts);
+                sketched.assign(nprocs, std::vector<KmerListS>(mytasks));
+            }
+        }
+
+        if (spill) {
+            std::vector<size_t> taskcnts(mytasks, 0);
+            for(int j = 0; j < mytasks; j++) {
+                size_t cnt = spill->spilled(j) ? spill->size(j) : bucket[j].size();
+                for(int i = 0; i < nprocs; i++) {
+                    cnt += recv_cnt[i][j];
+                }
+                taskcnts[j] = cnt * growth;
+            }
+            spill->plan(taskcnts);
+            staged.resize(nprocs);
+            staged_task.resize(nprocs, -1);
+            staged_pos.resize(nprocs, 0);
+        }
+
         recv_base[0].resize(mytasks, 0);
+        for(int j = 0; j < mytasks; j++) {
+            recv_base[0][j] = ondisk(j) ? spill->size(j) : bucket[j].size();
+        }
         for(int i = 1; i < nprocs; i++) {
             recv_base[i].resize(mytasks, 0);
             for(int j = 0; j < mytasks; j++) {
@@ -890,32 +1112,180 @@ struct BucketAssistant{
         }
 
         for(int i = 0; i < mytasks; i++) {
-            bucket[i].reserve(recv_base[nprocs-1][i] + recv_cnt[nprocs-1][i] + 256 / TKmer::NBYTES);
+            if ((filter && filter->marking()) || sketch) {
+                break;
+            }
+            if (ondisk(i)) {
+                spill->resize(i, recv_base[nprocs-1][i] + recv_cnt[nprocs-1][i]);
+                continue;
+            }
+            reserve(bucket[i], recv_base[nprocs-1][i] + recv_cnt[nprocs-1][i] + 256 / TKmer::NBYTES, growth);
             bucket[i].resize(recv_base[nprocs-1][i] + recv_cnt[nprocs-1][i]);
 
             // The 256 / TKmer::NBYTES is padded for RADULS
         }
     }    
+
+    template<typename T>
+    static void reserve(std::vector<T>& vec, size_t n, double growth) {
+        if (n > vec.capacity()) {
+            vec.reserve(std::max(n, static_cast<size_t>(n * growth)));
+        }
+    }
     
+    bool ondisk(int taskid) const {
+        return spill && spill->spilled(taskid);
+    }
+
     inline void insert(const int& procid, const int& taskid, const DnaSeq& seq) {
         size_t len = seq.size() - KMER_SIZE + 1;
 
-        auto repmers = TKmer::GetRepKmers(seq);
         size_t base = recv_base[procid][taskid] + current_recv[procid][taskid];
 
-        for (int i = 0; i < len; i++) {
-            bucket[taskid][base + i] = KmerSeedStruct(repmers[i]);
+        if (sketch) {
+            auto& staged = sketched[procid][taskid];
+            TKmer::ForEachRepKmer(seq, [&](int i, const TKmer& repmer) {
+                staged.emplace_back(repmer, 1);
+            });
+        } else if (filter && filter->marking()) {
+            TKmer::ForEachRepKmer(seq, [&](int i, const TKmer& repmer) {
+                filter->mark(taskid, hash_kmer(repmer));
+            });
+        } else if (filter && !ondisk(taskid)) {
+            /* kept k-mers are packed at the start of this sender's slice */
+            KmerSeedStruct* dest = bucket[taskid].data() + recv_base[procid][taskid];
+            size_t& n = kept[procid][taskid];
+            TKmer::ForEachRepKmer(seq, [&](int i, const TKmer& repmer) {
+                if (filter->repeated(taskid, hash_kmer(repmer))) {
+                    dest[n++] = KmerSeedStruct(repmer);
+                }
+            });
+        } else if (ondisk(taskid)) {
+            /* k-mers from one sender to one task are consecutive, so they can be written in runs */
+            auto& run = staged[procid];
+            if (!run.empty() && staged_task[procid] != taskid) {
+                flush(procid);
+            }
+            if (run.empty()) {
+                staged_task[procid] = taskid;
+                staged_pos[procid] = base;
+            }
+            TKmer::ForEachRepKmer(seq, [&](int i, const TKmer& repmer) {
+                run.emplace_back(repmer);
+            });
+            if (run.size() >= (1 << 16)) {
+                flush(procid);
+            }
+        } else {
+            /* straight into this sender's slice of the pre-sized bucket */
+            KmerSeedStruct* dest = bucket[taskid].data() + base;
+            TKmer::ForEachRepKmer(seq, [dest](int i, const TKmer& repmer) {
+                dest[i] = KmerSeedStruct(repmer);
+            });
         }
 
         current_recv[procid][taskid] += len;
     }
+
+    void flush(const int& procid) {
+        auto& run = staged[procid];
+        if (run.empty()) {
+            return;
+        }
+        spill->write(staged_task[procid], staged_pos[procid], run.data(), run.size());
+        staged_pos[procid] += run.size();
+        run.clear();
+    }
+
+    /*
+     * After the filtered exchange: moves the k-mers each sender left in its
+     * slice of a bucket next to each other, and returns how many were dropped.
+     * Buckets were sized for every received k-mer, so one that lost much of
+     * it is moved into a right-sized one (still padded for RADULS) before
+     * sorting, a task at a time.
+     */
+    size_t compact() {
+        size_t dropped = 0;
+        if (!filter || filter->marking()) {
+            return dropped;
+        }
+        for(int j = 0; j < mytasks; j++) {
+            if (ondisk(j)) {
+                continue;
+            }
+            size_t end = recv_base[0][j];
+            for(int i = 0; i < nprocs; i++) {
+                std::memmove(bucket[j].data() + end, bucket[j].data() + recv_base[i][j], kept[i][j] * sizeof(KmerSeedStruct));
+                end += kept[i][j];
+            }
+            dropped += bucket[j].size() - end;
+            bucket[j].resize(end);
+
+            size_t padded = end + 256 / TKmer::NBYTES;
+            if (bucket[j].capacity() > padded + padded / 8) {
+                std::vector<KmerSeedStruct> shrunk;
+                shrunk.reserve(padded);
+                shrunk.assign(bucket[j].begin(), bucket[j].end());
+                bucket[j].swap(shrunk);
+            }
+        }
+        return dropped;
+    }
+
+    /*
+     * Called once every sender's batch has been inserted. Each task's sketch
+     * is only touched by one thread, as updates are conservative.
+     */
+    void sketch_staged() {
+        if (!sketch) {
+            return;
+        }
+        #pragma omp parallel for num_threads(MAX_THREAD_MEMORY_BOUNDED) schedule(dynamic)
+        for(int j = 0; j < mytasks; j++) {
+            for(int i = 0; i < nprocs; i++) {
+                auto& staged = sketched[i][j];
+                for (const auto& entry : staged) {
+                    uint64_t hash = hash_kmer(entry.kmer);
+                    if (sketch->counting()) {
+                        sketch->add(j, hash, entry.cnt);
+                        continue;
+                    }
+                    uint64_t estimate = sketch->estimate(j, hash);
+                    if (estimate >= LOWER_KMER_FREQ && estimate <= UPPER_KMER_FREQ && sketch->first_emission(j, hash)) {
+                        kmerlists[j].emplace_back(entry.kmer, estimate);
+                    }
+                }
+                /* a batch can be large, don't keep that much for every sender and task */
+                if (staged.capacity() > (1 << 16)) {
+                    KmerListS().swap(staged);
+                } else {
+                    staged.clear();
+                }
+            }
+        }
+    }
+
+    /* called after each batch from @procid, so that staged runs don't pile up for every sender */
+    void batch_done(const int& procid) {
+        if (spill && !staged[procid].empty()) {
+            flush(procid);
+            std::vector<KmerSeedStruct>().swap(staged[procid]);
+        }
+    }
     
     inline void insert_list(const int& procid, const int& taskidx, uint8_t* addr, size_t len) {
         if (current_recv_list[taskidx][procid] + len > max_recv_list[taskidx][procid]) {
             std::cerr<<"Error: Exceeding the maximum length of the kmerlist. May lead to incorrect results."<<std::endl;
             return;
         }
-        memcpy(kmerlists[taskidx].data() + current_recv_list[taskidx][procid], addr, len * sizeof(KmerListEntryS));
+        if (sketch) {
+            auto& staged = sketched[procid][taskidx];
+            size_t n = staged.size();
+            staged.resize(n + len);
+            memcpy(staged.data() + n, addr, len * sizeof(KmerListEntryS));
+        } else {
+            memcpy(kmerlists[taskidx].data() + current_recv_list[taskidx][procid], addr, len * sizeof(KmerListEntryS));
+        }
         current_recv_list[taskidx][procid] += len;
     }
 
@@ -1026,6 +1396,7 @@ private:
         for (int i = 0; i < nprocs; i++) {
             parse_recvbuf(addr + i * batch_size, i);
         }
+        assistant.sketch_staged();
     }
 
 
@@ -1096,6 +1467,8 @@ private:
         recv_taskidx[procid] = taskidx;
         recv_idx[procid] = idx;
 
+        assistant.batch_done(procid);
+
         _bytes_sent[procid] += cnt;
         //std::cout<<"myrank "<<myrank<<" Parsed recvbuf for procid: "<<procid<<std::endl;
 
@@ -1116,12 +1489,16 @@ public:
                 TaskDispatcher& dispatcher,
                 KmerListSVec& kmerlists,
                 KmerListSVec& recv_kmerlists,
-                std::vector<size_t>& recv_kmerlist_lengths) : 
+                std::vector<size_t>& recv_kmerlist_lengths,
+                double growth = 1.0,
+                KmerSpill* spill = nullptr,
+                KmerFilter* filter = nullptr,
+                KmerSketch* sketch = nullptr) : 
         BatchExchanger(comm, batch_size, max_element_size, dispatcher), 
         nthr_membounded(nthr_membounded), lengths(lengths), supermers(supermers), 
         recv_cnt(recv_cnt), recv_length(recv_length), kmerlists(kmerlists), recv_list_cnt(recv_kmerlist_lengths),
         assistant(dispatcher.get_taskid(myrank).size(), nprocs, dispatcher.get_unbalanced_taskidx(myrank),
-        bucket, recv_kmerlists, recv_length, recv_kmerlist_lengths)
+        bucket, recv_kmerlists, recv_length, recv_kmerlist_lengths, growth, spill, filter, sketch)
         {
             // assistant = BucketAssistant(dispatcher.get_taskid(myrank), nprocs, bucket, recv_length);
             current_taskidx.resize(nprocs, 0);
@@ -1132,11 +1509,17 @@ public:
 
             recv_idx.resize(nprocs, 0);
             recv_taskidx.resize(nprocs, 0);
+            skip_empty_tasklists(current_taskidx, recv_taskidx);
             
             _bytes_sent.resize(nprocs, 0);
 
         }
 
+    /* see BucketAssistant::compact */
+    size_t compact() {
+        return assistant.compact();
+    }
+
     void print_stats() override {
         Logger logger(comm);
         
@@ -1200,7 +1583,52 @@ public:
 
 };
 
-std::pair<std::unique_ptr<KmerSeedBuckets>, std::unique_ptr<KmerListSVec>> exchange_supermer(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatch, int thr_per_worker = THREAD_PER_WORKER);
+std::pair<std::unique_ptr<KmerSeedBuckets>, std::unique_ptr<KmerListSVec>> exchange_supermer(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatch, int thr_per_worker = THREAD_PER_WORKER, KmerSpill* spill = nullptr, KmerFilter* filter = nullptr);
+
+/*
+ * Approximate alternative to exchange_supermer followed by filter_kmer: the
+ * received k-mers are counted in @sketch rather than stored, and those whose
+ * estimated count is within the frequency bounds are returned, with that
+ * estimate.
+ */
+std::unique_ptr<KmerListS>
+count_kmer_sketch(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatcher, KmerSketch& sketch, int thr_per_worker = THREAD_PER_WORKER);
+
+/*
+ * Replaces exchange_supermer and filter_kmer when the received k-mers of all
+ * tasks would not fit in @membudget bytes per processor: tasks are dispatched
+ * as usual, then exchanged, sorted and counted in as many passes over groups
+ * of tasks as needed for each pass to fit. The counted k-mers of all passes
+ * are returned together.
+ */
+std::unique_ptr<KmerListS>
+count_kmer_passes(ParallelData& data,
+     MPI_Comm comm,
+     TaskDispatcher& dispatcher,
+     size_t membudget,
+     int thr_per_worker = THREAD_PER_WORKER,
+     KmerSpill* spill = nullptr,
+     KmerFilter* filter = nullptr);
+
+/*
+ * Bounded-memory alternative to prepare_supermer followed by exchange_supermer:
+ * my reads are taken in chunks of about @chunkbases nucleotides, and each chunk
+ * is turned into supermers and exchanged before the next one is looked at, so
+ * that only one chunk's supermers are held at a time. The reads are not
+ * chunked: @myreads holds all of them throughout, so this bounds the supermer
+ * buffers, not peak memory as a whole.
+ * The next chunk is encoded while the current one is being exchanged. Tasks
+ * are dispatched according to the first chunk of every processor.
+ */
+std::pair<std::unique_ptr<KmerSeedBuckets>, std::unique_ptr<KmerListSVec>>
+stream_supermer(const DnaBuffer& myreads,
+     MPI_Comm comm,
+     TaskDispatcher& dispatcher,
+     size_t chunkbases,
+     int thr_per_worker = THREAD_PER_WORKER,
+     int max_thr_membounded = MAX_THREAD_MEMORY_BOUNDED,
+     KmerSpill* spill = nullptr,
+     int max_supermer_len = MAX_SUPERMER_LEN);
 
 
 struct KmerParserHandler
@@ -1238,47 +1666,60 @@ void ForeachKmerParallel(const DnaBuffer& myreads, std::vector<KmerHandler>& han
             continue;
 
         /*
-         * Get all the representative k-mer seeds.
+         * Go through each representative k-mer seed.
          */
-        std::vector<TKmer> repmers = TKmer::GetRepKmers(myreads[i]);
-
-        size_t j = 0;
-
-        /*
-         * Go through each k-mer seed.
-         */
-        for (auto meritr = repmers.begin(); meritr != repmers.end(); ++meritr, ++j)
-        {
-            handlers[tid](*meritr, j, i);
-        }
+        TKmer::ForEachRepKmer(myreads[i], [&](int j, const TKmer& repmer) {
+            handlers[tid](repmer, j, i);
+        });
     }
 }
 
-struct Minimizer_Deque {
+/*
+ * Monotone queue of the m-mer hashes in the current k-mer window, front
+ * first. A window has KMER_SIZE - MINIMIZER_SIZE + 1 m-mers, so a fixed
+ * ring of that size always fits the queue as long as the m-mer leaving the
+ * window is removed before the one entering it is inserted.
+ */
+struct Minimizer_Ring {
+
+    static constexpr int WINDOW = KMER_SIZE - MINIMIZER_SIZE + 1;
 
-    /* The first item is the hash value, the second one is the position of the minimizer */
-    std::deque<std::pair<uint64_t, int>> deq;
+    uint64_t hashes[WINDOW];
+    int positions[WINDOW];
+    int front = 0;
+    int len = 0;
 
     void remove_minimizer(int pos) {
-        while (!deq.empty() && deq.front().second <= pos) {
-            deq.pop_front();
+        while (len > 0 && positions[front] <= pos) {
+            front = front + 1 == WINDOW ? 0 : front + 1;
+            len--;
         }
     }
 
     void insert_minimizer(uint64_t hash, int pos) {
-        while (!deq.empty() && deq.back().first < hash) {
-            deq.pop_back();
+        int back = front + len - 1;
+        back = back >= WINDOW ? back - WINDOW : back;
+        while (len > 0 && hashes[back] < hash) {
+            back = back == 0 ? WINDOW - 1 : back - 1;
+            len--;
         }
-        deq.push_back(std::make_pair(hash, pos));
+        back = back + 1 == WINDOW ? 0 : back + 1;
+        hashes[back] = hash;
+        positions[back] = pos;
+        len++;
     }
 
-    uint64_t get_current_minimizer() {
-        return deq.front().first;
+    uint64_t get_current_minimizer() const {
+        return hashes[front];
     }
 };
 
 int GetMinimizerOwner(const uint64_t& hash, int tot_tasks);
 
-void FindKmerDestinationsParallel(const DnaBuffer& myreads, int nthreads, int tot_tasks, ParallelData& data);
+/*
+ * Finds the minimizer task of every k-mer of reads [@first, @last) and
+ * encodes the supermers into each thread's buffers in @data, in one pass.
+ */
+void EncodeSupermersParallel(const DnaBuffer& myreads, size_t first, size_t last, int nthreads, int tot_tasks, ParallelData& data);
 
 #endif // KMEROPS_H_
\ No newline at end of file
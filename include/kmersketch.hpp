@@ -0,0 +1,115 @@
+#ifndef KMER_SKETCH_H_
+#define KMER_SKETCH_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include "compiletime.h"
+
+/*
+ * Count-min sketches, one per task, for approximate counting in a fixed
+ * amount of memory. The same supermers are exchanged twice: during the
+ * first exchange every received k-mer is @add'ed to its task's sketch,
+ * during the second every k-mer whose @estimate is within
+ * [LOWER_KMER_FREQ, UPPER_KMER_FREQ] is emitted, once (see @first_emission).
+ *
+ * Updates are conservative: only the counters that are at the current
+ * minimum are raised, which keeps estimates closer to the true count but
+ * makes an update a read-modify-write over all rows. A task's sketch must
+ * therefore be updated by one thread at a time.
+ *
+ * The budget is shared out between tasks in proportion to the number of
+ * k-mers they receive; a quarter of it goes to the bitmaps that remember
+ * which k-mers were emitted. Estimates are never below the true count, and
+ * a k-mer is occasionally not emitted when its bits are taken already.
+ *
+ * Elements are known by their hash only. Tasks are identified by their local
+ * index on this processor.
+ */
+class KmerSketch
+{
+public:
+    static constexpr int DEPTH = 4;
+
+    /* @budget is in bytes per processor */
+    KmerSketch(size_t budget) : budget(budget), planned(false), emitting(false) {}
+
+    /*
+     * @taskcnts[i] is the number of k-mers task i receives. Only the first
+     * call after construction or @reset allocates, later ones keep the sketches.
+     */
+    void plan(const std::vector<size_t>& taskcnts);
+
+    /* during the first exchange */
+    bool counting() const { return planned && !emitting; }
+
+    /* switch to the second exchange */
+    void emit() { emitting = true; }
+
+    inline void add(size_t task, uint64_t hash, uint64_t cnt)
+    {
+        KmerCounter* rows = counters[task].data();
+        size_t width = widths[task];
+        size_t idx[DEPTH];
+        uint64_t current = std::numeric_limits<KmerCounter>::max();
+
+        for (int d = 0; d < DEPTH; ++d)
+        {
+            idx[d] = d * width + column(hash, d, width);
+            current = std::min<uint64_t>(current, rows[idx[d]]);
+        }
+
+        uint64_t target = std::min<uint64_t>(current + cnt, std::numeric_limits<KmerCounter>::max());
+
+        for (int d = 0; d < DEPTH; ++d)
+            if (rows[idx[d]] < target) rows[idx[d]] = target;
+    }
+
+    inline uint64_t estimate(size_t task, uint64_t hash) const
+    {
+        const KmerCounter* rows = counters[task].data();
+        size_t width = widths[task];
+        uint64_t current = std::numeric_limits<KmerCounter>::max();
+
+        for (int d = 0; d < DEPTH; ++d)
+            current = std::min<uint64_t>(current, rows[d * width + column(hash, d, width)]);
+
+        return current;
+    }
+
+    /* sets the emitted bits of @hash, and tells whether any was unset */
+    inline bool first_emission(size_t task, uint64_t hash)
+    {
+        uint64_t& word = emitted[task][((hash & 0xffffffffULL) * emitted[task].size()) >> 32];
+        uint64_t bits = (1ULL << (hash >> 58)) | (1ULL << ((hash >> 52) & 63)) | (1ULL << ((hash >> 46) & 63));
+        bool first = (word & bits) != bits;
+        word |= bits;
+        return first;
+    }
+
+    /* free the sketches and forget the plan */
+    void reset();
+
+    size_t bytes() const;
+
+private:
+    size_t budget;
+    bool planned;
+    bool emitting;
+    std::vector<std::vector<KmerCounter>> counters; /* DEPTH rows of widths[task] counters */
+    std::vector<size_t> widths;
+    std::vector<std::vector<uint64_t>> emitted;
+
+    /*
+     * Double hashing: row @d looks at hash + d * (hash rotated by 32),
+     * mapped onto [0, width) by its high bits.
+     */
+    static inline size_t column(uint64_t hash, int d, size_t width)
+    {
+        uint64_t h = hash + d * (((hash << 32) | (hash >> 32)) | 1);
+        return static_cast<size_t>((static_cast<unsigned __int128>(h) * width) >> 64);
+    }
+};
+
+#endif
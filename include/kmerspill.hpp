@@ -0,0 +1,72 @@
+#ifndef KMER_SPILL_H_
+#define KMER_SPILL_H_
+
+#include <mpi.h>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/*
+ * Out-of-core storage for the receive buckets of k-mer counting. Before a
+ * processor allocates its buckets, @plan picks the largest tasks to keep on
+ * node-local scratch instead, until the rest fits in the memory budget.
+ * Received k-mers of a spilled task are written to its own file at the same
+ * positions they would take in its bucket (so that writers don't need to
+ * coordinate), and the task is later read back, sorted and counted on its own.
+ *
+ * Elements are opaque here, only their size matters. Tasks are identified
+ * by their local index on this processor.
+ */
+class KmerSpill
+{
+public:
+    /*
+     * @budget is in bytes per processor; with 0 the free memory on the node,
+     * shared between the processes running on it, is used instead.
+     */
+    KmerSpill(const std::string& scratchdir, size_t budget, size_t elemsize, MPI_Comm comm);
+    ~KmerSpill() { reset(); }
+
+    KmerSpill(const KmerSpill&) = delete;
+    KmerSpill& operator=(const KmerSpill&) = delete;
+
+    /*
+     * @taskcnts[i] is the number of elements task i is expected to end up with.
+     * A bucket takes twice the element size per element (the sort needs as much
+     * again). Only the first call after construction or @reset decides,
+     * later ones keep the decision.
+     */
+    void plan(const std::vector<size_t>& taskcnts);
+
+    bool spilled(size_t task) const { return task < files.size() && files[task] != -1; }
+    bool anyspilled() const { return numspilled > 0; }
+
+    size_t size(size_t task) const { return sizes[task]; }
+    void resize(size_t task, size_t n) { sizes[task] = n; }
+
+    /*
+     * Thread safe as long as concurrent writes go to disjoint ranges.
+     */
+    void write(size_t task, size_t pos, const void *elems, size_t n) const;
+    void read(size_t task, void *elems) const;
+
+    /* delete the file of @task */
+    void remove(size_t task);
+
+    /* delete all files and forget the plan */
+    void reset();
+
+private:
+    std::string scratchdir;
+    size_t budget;
+    size_t elemsize;
+    int myrank;
+    bool planned;
+    size_t numspilled;
+    std::vector<int> files; /* file descriptor of each task, -1 if the task is in memory */
+    std::vector<size_t> sizes; /* number of elements of each spilled task */
+
+    std::string filename(size_t task) const;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef READ_CACHE_H_
+#define READ_CACHE_H_
+
+#include <mpi.h>
+#include "dnabuffer.hpp"
+#include "compiletime.h"
+
+/*
+ * Binary cache of 2-bit encoded reads, so that repeated runs on the same
+ * input (e.g. with different K, L or U builds) skip parsing altogether.
+ * Layout (native byte order):
+ *
+ *     header      magic, number of reads, number of sequence bytes
+ *     lengths     one uint64_t per read, in global read order
+ *     sequences   the DnaBuffer storage of all reads, back to back
+ *
+ * Each read takes DnaSeq::bytesneeded(length) bytes, so the sequence bytes
+ * of any contiguous range of reads follow from their lengths. Nothing about
+ * the processor count is stored: a cache can be read by any number of
+ * processors.
+ *
+ * Pieces of split records (see FastaIndex::getpartition) are stored without
+ * the bases they share with the next piece, and with the top bit of their
+ * length (CONTINUED) set. Those pieces are a multiple of 4 bases long, so a
+ * record's pieces are its 2-bit encoding, back to back. Readers extend every
+ * continued piece with KMER_SIZE-1 bases of what follows, for their own
+ * KMER_SIZE.
+ */
+class ReadCache
+{
+public:
+    ReadCache(const std::string& cache_fname, MPI_Comm comm);
+
+    MPI_Comm getcomm() const { return comm; }
+    std::string get_cache_fname() const { return cache_fname; }
+
+    /*
+     * Read counts and displacements are only known after @getmydna.
+     */
+    size_t gettotrecords() const { return readdispls.back(); }
+    size_t getreadcount(size_t i) const { return static_cast<size_t>(readcounts[i]); }
+    size_t getreaddispl(size_t i) const { return static_cast<size_t>(readdispls[i]); }
+    size_t getmyreadcount() const { return getreadcount(myrank); }
+    size_t getmyreaddispl() const { return getreaddispl(myrank); }
+
+    /*
+     * Collectively read my share of the reads, balanced by sequence bytes.
+     */
+    DnaBuffer getmydna();
+
+    /*
+     * Collectively write everyone's reads (in processor order) to the cache.
+     * @overlaps are the numbers of bases each read shares with the next
+     * (empty if none do).
+     */
+    void write(const DnaBuffer& mydna, const std::vector<size_t>& overlaps) const;
+
+    /*
+     * Whether @fname exists and starts with the cache magic bytes. Only the
+     * root reads the file, everyone gets the answer.
+     */
+    static bool iscache(const std::string& fname, MPI_Comm comm);
+
+private:
+    MPI_Comm comm;
+    std::string cache_fname;
+    std::vector<MPI_Count_t> readcounts; /* number of reads assigned to each processor. |readcounts| == nprocs */
+    std::vector<MPI_Offset_t> readdispls; /* displacement counts for reads across all processors. |readdispls| == nprocs+1 */
+    int nprocs, myrank;
+
+    struct Header
+    {
+        char magic[8];
+        uint64_t numreads;
+        uint64_t numbytes;
+    };
+
+    static constexpr char magic[8] = {'U', 'K', 'M', 'R', 'C', '2', 'B', '\3'};
+    static constexpr uint64_t CONTINUED = 1ULL << 63;
+};
+
+#endif
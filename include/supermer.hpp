@@ -15,7 +15,7 @@
 #include "hashfuncs.hpp"
 #include "dnaseq.hpp"
 
-#define MAX_SUPERMER_LEN 256
+#define MAX_SUPERMER_LEN 256 /* default, can be changed at runtime */
 
 template <int MLONGS>
 class Mmer
@@ -59,6 +59,14 @@ public:
     static std::vector<Mmer> GetMmers(const DnaSeq& s);
     static std::vector<Mmer> GetRepMmers(const DnaSeq& s);
 
+    /*
+     * Calls @f(i, rep) for the representative of every m-mer of @s, in order,
+     * rolling the m-mer and its reverse complement along one base at a time
+     * (see Kmer::ForEachRepKmer). Nothing is allocated.
+     */
+    template <typename F>
+    static void ForEachRepMmer(const DnaSeq& s, F&& f);
+
     template <int N>
     friend std::ostream& operator<<(std::ostream& os, const Mmer<N>& kmer);
 
@@ -253,7 +261,7 @@ Mmer<MLONGS> Mmer<MLONGS>::GetExtension(int code) const
         ext.longs[i] = longs[i] << 2;
     }
 
-    ext.longs[MLONGS-1] |= (static_cast<uint64_t>(code) << (2 * (32 - (MINIMIZER_SIZE%32))));
+    ext.longs[MLONGS-1] |= (static_cast<uint64_t>(code) << (2 * ((32 - (MINIMIZER_SIZE%32)) % 32)));
 
     return ext;
 }
@@ -301,6 +309,13 @@ Mmer<MLONGS> Mmer<MLONGS>::GetRep() const
 template <int MLONGS>
 uint64_t Mmer<MLONGS>::GetHash() const
 {
+    /*
+     * An m-mer that fits in one word gets the (invertible) Wang hash of its
+     * right-aligned bits, which is much cheaper than MurmurHash.
+     */
+    if (MLONGS == 1)
+        return wanghash64(longs[0] >> (64 - 2 * MINIMIZER_SIZE));
+
     uint64_t h;
     murmurhash3_64(longs.data(), NBYTES, &h);
     return h;
@@ -335,6 +350,40 @@ std::vector<Mmer<MLONGS>> Mmer<MLONGS>::GetRepMmers(const DnaSeq& s)
     return kmers;
 }
 
+template <int MLONGS>
+template <typename F>
+void Mmer<MLONGS>::ForEachRepMmer(const DnaSeq& s, F&& f)
+{
+    int num_mmers = static_cast<int>(s.size()) - MINIMIZER_SIZE + 1;
+
+    if (num_mmers <= 0) return;
+
+    constexpr int last = (MINIMIZER_SIZE - 1) / 32;
+    constexpr int lastshift = 2 * (31 - ((MINIMIZER_SIZE - 1) % 32));
+    constexpr uint64_t lastmask = ~((1ULL << lastshift) - 1);
+
+    Mmer fwd, rev;
+
+    int i = 0;
+
+    s.foreachcode([&](int c)
+    {
+        uint64_t code = static_cast<uint64_t>(c);
+
+        for (int l = 0; l < last; ++l)
+            fwd.longs[l] = (fwd.longs[l] << 2) | (fwd.longs[l+1] >> 62);
+        fwd.longs[last] = (fwd.longs[last] << 2) | (code << lastshift);
+
+        for (int l = last; l > 0; --l)
+            rev.longs[l] = (rev.longs[l] >> 2) | (rev.longs[l-1] << 62);
+        rev.longs[0] = (rev.longs[0] >> 2) | ((3 - code) << 62);
+        rev.longs[last] &= lastmask;
+
+        if (i >= MINIMIZER_SIZE - 1)
+            f(i - MINIMIZER_SIZE + 1, rev < fwd? rev : fwd);
+        ++i;
+    });
+}
 
 using TMmer = typename std::conditional<(MINIMIZER_SIZE <= 32), Mmer<1>,
               typename std::conditional<(MINIMIZER_SIZE <= 64), Mmer<2>,
@@ -1,5 +1,6 @@
 #include "dnabuffer.hpp"
 #include <cassert>
+#include <algorithm>
 #include <sstream>
 
 DnaBuffer::DnaBuffer(size_t bufsize, size_t numreads, uint8_t *buf, const size_t *readlens) : bufhead(0), bufsize(bufsize), buf(buf)
@@ -28,6 +29,45 @@ void DnaBuffer::push_back(char const *s, size_t len)
     bufhead += nbytes;
 }
 
+void DnaBuffer::fill(size_t i, char const *s)
+{
+    /*
+     * Sequence @i already has its slot reserved in @buf (see the
+     * pre-allocating constructor), so distinct sequences can be
+     * encoded concurrently without touching @bufhead.
+     */
+    assert(i < sequences.size());
+    uint8_t *mem = const_cast<uint8_t*>(sequences[i].data());
+    sequences[i] = DnaSeq(s, sequences[i].size(), mem);
+}
+
+void DnaBuffer::fill(size_t i, char const *s, size_t linelen, size_t col)
+{
+    /*
+     * Same as above, but @s points to a sequence wrapped into lines of
+     * @linelen nucleotides that are each followed by a newline (as in a
+     * FASTA file), starting at column @col of its first line. Lines are
+     * encoded in place, without unwrapping them first.
+     */
+    assert(i < sequences.size());
+    uint8_t *mem = const_cast<uint8_t*>(sequences[i].data());
+    size_t len = sequences[i].size();
+
+    if (len == 0) return;
+    assert(linelen > col);
+
+    size_t pos = 0;
+    size_t cnt = std::min(linelen - col, len);
+
+    while (pos < len)
+    {
+        DnaSeq::encode_at(s, cnt, mem, pos);
+        s += (cnt+1);
+        pos += cnt;
+        cnt = std::min(linelen, len - pos);
+    }
+}
+
 size_t DnaBuffer::getrangebufsize(size_t start, size_t count) const
 {
     if (start + count == 0) return 0;
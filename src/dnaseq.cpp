@@ -4,10 +4,24 @@
 #include <vector>
 #include <cmath>
 
-void DnaSeq::compress(char const *s)
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/*
+ * codetab, except that non-nucleotides (4 there) are A rather than spill
+ * into the neighbouring nucleotide's bits, as in the AVX2 kernel.
+ */
+static inline uint8_t basecode(char c)
+{
+    uint8_t code = DnaSeq::codetab[static_cast<unsigned char>(c)];
+    return code > 3? 0 : code;
+}
+
+void DnaSeq::encode_scalar(char const *s, size_t n, uint8_t *mem)
 {
-    const size_t nbytes = numbytes();
-    const int remain = remainder();
+    const size_t nbytes = bytesneeded(n);
+    const int remain = 4*nbytes - n;
     char const *p = s;
     size_t b = 0;
 
@@ -18,16 +32,99 @@ void DnaSeq::compress(char const *s)
 
         for (int i = 0; i < left; ++i)
         {
-            uint8_t code = DnaSeq::getcharcode(p[i]);
+            uint8_t code = basecode(p[i]);
             uint8_t shift = code << (6 - (2*i));
             byte |= shift;
         }
 
-        memory[b++] = byte;
+        mem[b++] = byte;
         p += 4;
     }
 }
 
+#ifdef __AVX2__
+
+void DnaSeq::encode(char const *s, size_t n, uint8_t *mem)
+{
+    /*
+     * The low nibbles of A, C, G and T (either case) are 1, 3, 7 and 4, which
+     * are all distinct, so a 16-entry shuffle table maps ASCII straight to
+     * 2-bit codes. Other characters share nibbles with these (S with C, W with
+     * G, ...), so codes are kept only where the lower-cased character really
+     * is c, g or t; everything else (N included) goes to A, as in basecode.
+     */
+    const __m256i lut = _mm256_setr_epi8(0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0,
+                                         0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i c = _mm256_set1_epi8('c');
+    const __m256i g = _mm256_set1_epi8('g');
+    const __m256i t = _mm256_set1_epi8('t');
+    const __m256i pairw = _mm256_set1_epi16(0x0104); /* bytes {4, 1}: c0*4 + c1 */
+    const __m256i quadw = _mm256_set1_epi32(0x00010010); /* words {16, 1}: (c0c1)*16 + c2c3 */
+    const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+
+    /*
+     * 32 nucleotides in, 8 bytes out. Each 32-bit lane ends up holding one
+     * output byte (c0<<6 | c1<<4 | c2<<2 | c3), which are then gathered into
+     * the low 4 bytes of each 128-bit half.
+     */
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i folded = _mm256_or_si256(chars, lower);
+        __m256i known = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(folded, c), _mm256_cmpeq_epi8(folded, g)), _mm256_cmpeq_epi8(folded, t));
+        __m256i codes = _mm256_and_si256(_mm256_shuffle_epi8(lut, _mm256_and_si256(chars, nibble)), known);
+        __m256i packed = _mm256_madd_epi16(_mm256_maddubs_epi16(codes, pairw), quadw);
+        packed = _mm256_shuffle_epi8(packed, gather);
+
+        uint64_t word = static_cast<uint32_t>(_mm256_extract_epi32(packed, 0)) |
+                        (static_cast<uint64_t>(static_cast<uint32_t>(_mm256_extract_epi32(packed, 4))) << 32);
+
+        std::memcpy(mem + i/4, &word, sizeof(word));
+    }
+
+    encode_scalar(s + i, n - i, mem + i/4);
+}
+
+#else
+
+void DnaSeq::encode(char const *s, size_t n, uint8_t *mem)
+{
+    encode_scalar(s, n, mem);
+}
+
+#endif
+
+void DnaSeq::encode_at(char const *s, size_t n, uint8_t *mem, size_t offset)
+{
+    mem += offset / 4;
+    int pos = offset % 4;
+
+    /*
+     * Finish the partially encoded byte first (keeping the
+     * nucleotides already there) so that the rest is byte aligned.
+     */
+    if (pos != 0 && n > 0)
+    {
+        uint8_t byte = *mem & static_cast<uint8_t>(0xff << (8 - 2*pos));
+
+        for (; pos < 4 && n > 0; ++pos, --n)
+            byte |= basecode(*s++) << (6 - (2*pos));
+
+        *mem++ = byte;
+    }
+
+    encode(s, n, mem);
+}
+
+void DnaSeq::compress(char const *s)
+{
+    encode(s, size(), memory);
+}
+
 std::string DnaSeq::ascii() const
 {
     size_t len = size();
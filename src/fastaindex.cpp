@@ -1,7 +1,9 @@
 #include "fastaindex.hpp"
 #include "logger.hpp"
 #include "timer.hpp"
+#include "fileio.hpp"
 #include <cstring>
+#include <cstdlib>
 #include <iterator>
 #include <algorithm>
 #include <functional>
@@ -11,20 +13,20 @@
 #include <iostream>
 #include <memory>
 #include <mpi.h>
+#include <omp.h>
 #include <cassert>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cerrno>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using Record = typename FastaIndex::Record;
 
-Record FastaIndex::get_faidx_record(const std::string& line, std::string& name)
-{
-    /*
-     * Read a line from a FASTA index file into a record object.
-     */
-    Record record;
-    std::istringstream(line) >> name >> record.len >> record.pos >> record.bases;
-    return record;
-}
-
 int FastaIndex::getreadowner(size_t i) const
 {
     /*
@@ -47,144 +49,535 @@ int FastaIndex::getreadowner(size_t i) const
     return static_cast<int>(iditr - readdispls.cbegin());
 }
 
-void FastaIndex::getpartition(std::vector<MPI_Count_t>& sendcounts)
+/*
+ * Each record is represented with four numbers (read length,
+ * FASTA position, FASTA line width, FASTA file id), so we create
+ * an MPI datatype to communicate each record as a single unit.
+ */
+static MPI_Datatype create_faidx_dtype()
 {
-    assert(sendcounts.size() == (uint64_t)nprocs);
+    static_assert(sizeof(Record) == 6 * sizeof(unsigned long long));
 
-    size_t totbases = std::accumulate(rootrecords.begin(), rootrecords.end(), static_cast<size_t>(0), [](size_t sum, const auto& record) { return sum + record.len; });
-    size_t numreads = rootrecords.size();
-    double avgbasesperproc = static_cast<double>(totbases) / nprocs;
+    MPI_Datatype faidx_dtype_t;
+    MPI_Type_contiguous(6, MPI_UNSIGNED_LONG_LONG, &faidx_dtype_t);
+    MPI_Type_commit(&faidx_dtype_t);
+    return faidx_dtype_t;
+}
+
+/*
+ * Parse the line [line..end) of a FASTA index file into a record. Only the
+ * numeric columns are needed, the sequence name is skipped over (see
+ * @getmyreadnames for how names are obtained). Returns false for lines
+ * that aren't index records (e.g. blank lines).
+ */
+static bool parse_faidx_line(char const *line, char const *end, Record& record)
+{
+    auto tab = static_cast<char const*>(std::memchr(line, '\t', end - line));
+
+    if (!tab) return false;
+
+    char *next;
+    record.len = std::strtoull(tab+1, &next, 10);
+    record.pos = std::strtoull(next, &next, 10);
+    record.bases = std::strtoull(next, &next, 10);
+    record.col = 0;
+    record.overlap = 0;
+
+    return true;
+}
+
+/*
+ * Last byte past the sequence lines of @record, i.e. the position at which
+ * the gap before the following record's sequence (its header line) begins.
+ */
+static size_t record_end(const Record& record)
+{
+    return record.pos + record.len + (record.bases? (record.col + record.len) / record.bases : 0);
+}
+
+FastaIndex::FastaIndex(const std::vector<std::string>& fasta_fnames, MPI_Comm comm, bool writefai) :  comm(comm), fasta_fnames(fasta_fnames)
+{
+
+    MPI_Comm_size(comm, &nprocs);
+    MPI_Comm_rank(comm, &myrank);
+    readcounts.resize(nprocs);
 
     /*
-     * Coming up with the optimal partitioning of sequences weighted by their length
-     * is NP-hard, and I can't imagine that it is NP-complete also (how would you verify
-     * in polynomial time?). Tried looking for the name of this optimization problem
-     * but couldn't find (didn't look too hard because its not too important for this).
-     * It's basically a variation on multiway number partition, except where the divisions
-     * must be ordered. The following seems like a fine approxmimation. Note that the
-     * the last processor tends to get more than the average amount of data.
+     * Use the FASTA index file "{fasta_fname}.fai" if there is one.
+     * Otherwise the index is built from the FASTA itself, in parallel.
+     */
+    int numfiles = getnumfiles();
+    std::vector<int> havefaidx(numfiles, 0);
+
+    if (myrank == 0)
+    {
+        for (int i = 0; i < numfiles; ++i)
+            havefaidx[i] = std::ifstream(get_faidx_fname(i)).good();
+    }
+
+    MPI_Bcast(havefaidx.data(), numfiles, MPI_INT, 0, comm);
+
+    /*
+     * Every processor ends up with a share of each file's records, in file
+     * order. The shares of all files are then partitioned together, as if
+     * the files were one concatenated FASTA.
+     */
+    std::vector<Record> records;
+
+    for (int i = 0; i < numfiles; ++i)
+    {
+        auto filerecords = havefaidx[i]? readfaidx(i) : buildfaidx(i, writefai);
+        records.insert(records.end(), filerecords.begin(), filerecords.end());
+    }
+
+    distribute(records);
+
+    #if LOG_LEVEL >= 2
+    Logger logger(comm);
+    size_t mytotbases = std::accumulate(myrecords.begin(), myrecords.end(), static_cast<size_t>(0), [](size_t sum, const auto& record) { return sum + record.len; });
+    size_t totbases;
+    MPI_Allreduce(&mytotbases, &totbases, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    double percent_proportion = (static_cast<double>(mytotbases) / totbases) * 100.0;
+    logger() << " is responsible for sequences " << Logger::readrangestr(readdispls[myrank], readcounts[myrank]) << " (" << mytotbases << " nucleotides, " << std::fixed << std::setprecision(3) << percent_proportion << "%)";
+    logger.flush("Fasta index construction:");
+    #endif
+}
+
+std::vector<Record> FastaIndex::readfaidx(int fileid)
+{
+    MPI_File fh;
+    MPI_Offset filesize;
+
+    MPI_File_open(comm, get_faidx_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+    MPI_File_get_size(fh, &filesize);
+
+    /*
+     * Every processor parses an equal share [mystart..myend) of "{fasta_fname}.fai",
+     * and a line belongs to the processor whose share holds its first byte. As
+     * in @buildfaidx, the byte before the share tells us whether the share begins
+     * at the start of a line. Index lines are in FASTA order, so the shares are
+     * in processor order too, which is all @distribute needs.
      */
+    MPI_Offset mystart = (filesize * myrank) / nprocs;
+    MPI_Offset myend = (filesize * (myrank+1)) / nprocs;
+    MPI_Offset readstart = mystart > 0? mystart-1 : 0;
+
+    std::string contents(myend - readstart, '\0');
+    read_at_chunked(fh, readstart, &contents[0], myend - readstart);
 
-    size_t readid = 0;
+    size_t shareend = myend - readstart;
+    size_t linestart = mystart - readstart;
 
-    for (int i = 0; i < nprocs-1; ++i)
+    if (mystart > 0 && contents[0] != '\n')
     {
-        size_t basessofar = 0;
-        size_t startid = readid;
+        linestart = contents.find('\n', linestart);
+        linestart = linestart == std::string::npos? shareend : linestart+1;
+    }
+
+    std::vector<Record> records;
+
+    while (linestart < shareend)
+    {
+        size_t lineend = contents.find('\n', linestart);
 
         /*
-         * Keep going through reads until the next one puts us over
-         * the average bases per processor.
+         * My last line can run past the end of my share.
          */
-        do
+        while (lineend == std::string::npos && readstart + static_cast<MPI_Offset>(contents.size()) < filesize)
         {
-            basessofar += rootrecords[readid].len;
-            readid++;
-        } while (readid < numreads && basessofar + rootrecords[readid].len < avgbasesperproc);
+            size_t have = contents.size();
+            size_t more = std::min(static_cast<size_t>(1 << 16), static_cast<size_t>(filesize - readstart - have));
+            contents.resize(have + more);
+            read_at_chunked(fh, readstart + have, &contents[have], more);
+            lineend = contents.find('\n', linestart);
+        }
 
+        if (lineend == std::string::npos) lineend = contents.size();
 
+        Record record;
+        record.fileid = fileid;
 
-        size_t readssofar = readid - startid;
-        assert(readssofar >= 1); /* TODO: come up with a recovery strategy here */
-        assert(readid <= numreads); /* TODO: come up with a recovery strategy here */
+        if (parse_faidx_line(contents.data() + linestart, contents.data() + lineend, record))
+            records.push_back(record);
 
-        sendcounts[i] = readssofar;
+        linestart = lineend+1;
     }
 
-    /*
-     * Last processor gets the remaining reads.
-     */
-    sendcounts.back() = numreads - readid;
+    MPI_File_close(&fh);
+
+    return records;
 }
 
-FastaIndex::FastaIndex(const std::string& fasta_fname, MPI_Comm comm) :  fasta_fname(fasta_fname), comm(comm)
+std::vector<Record> FastaIndex::buildfaidx(int fileid, bool writefai)
 {
+    MPI_File fh;
+    MPI_Offset filesize;
 
-    MPI_Comm_size(comm, &nprocs);
-    MPI_Comm_rank(comm, &myrank);
-    readcounts.resize(nprocs);
+    MPI_File_open(comm, get_fasta_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+    MPI_File_get_size(fh, &filesize);
 
+    /*
+     * Every processor scans an equal share [mystart..myend) of the FASTA, and
+     * a record belongs to the processor whose share holds the '>' starting its
+     * header line. The byte just before the share is read as well, so that we
+     * know whether the share begins at the start of a line.
+     */
+    MPI_Offset mystart = (filesize * myrank) / nprocs;
+    MPI_Offset myend = (filesize * (myrank+1)) / nprocs;
+    MPI_Offset readstart = mystart > 0? mystart-1 : 0;
 
+    std::unique_ptr<char[]> readbuf(new char[myend - readstart]);
+    read_at_chunked(fh, readstart, &readbuf[0], myend - readstart);
+
+    char const *share = &readbuf[mystart - readstart];
+    size_t sharelen = myend - mystart;
+    bool linestart = (mystart == 0 || readbuf[0] == '\n');
 
     /*
-     * Root processor responsible for reading and parsing FASTA
-     * index file "{fasta_fname}.fai" into one record per sequence.
+     * Scan the share for header lines, split among threads. Besides the header
+     * positions we count newlines: a record's length is the number of bytes
+     * between the end of its header line and the next header, minus the number
+     * of newlines in between, and newline counts are easily made global with
+     * prefix sums (over threads, then over processors).
      */
-    if (myrank == 0)
+    int nthreads = omp_get_max_threads();
+    std::vector<std::vector<std::pair<size_t, size_t>>> thrdheaders(nthreads); /* (share offset, newlines in thread piece before it) */
+    std::vector<size_t> thrdnewlines(nthreads+1, 0);
+
+    #pragma omp parallel num_threads(nthreads)
     {
-        std::string line, name;
-        std::ifstream filestream(get_faidx_fname());
+        int tid = omp_get_thread_num();
+        size_t pb = (sharelen * tid) / nthreads;
+        size_t pe = (sharelen * (tid+1)) / nthreads;
+        size_t newlines = 0;
+
+        if (pb < pe && share[pb] == '>' && (pb == 0? linestart : share[pb-1] == '\n'))
+            thrdheaders[tid].emplace_back(pb, 0);
+
+        char const *q = share + pb;
+        char const *end = share + pe;
 
-        while (std::getline(filestream, line))
+        while ((q = static_cast<char const*>(std::memchr(q, '\n', end - q))) != nullptr)
         {
-            rootrecords.push_back(get_faidx_record(line, name));
-            rootnames.push_back(name);
+            newlines++;
+            q++;
+
+            if (q < end && *q == '>')
+                thrdheaders[tid].emplace_back(q - share, newlines);
         }
 
-        filestream.close();
+        thrdnewlines[tid+1] = newlines;
+    }
 
-        /*
-         * Compute load-balanced read partitioning on the root processor.
-         */
-        getpartition(readcounts);
+    std::partial_sum(thrdnewlines.begin(), thrdnewlines.end(), thrdnewlines.begin());
+
+    std::vector<MPI_Offset> headers; /* file positions of my header lines */
+    std::vector<size_t> hdrnewlines; /* number of newlines in the FASTA before each of my header lines */
+
+    size_t mynewlines = thrdnewlines.back();
+    size_t newlinesbefore = 0;
+    MPI_Exscan(&mynewlines, &newlinesbefore, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    if (myrank == 0) newlinesbefore = 0;
+
+    for (int t = 0; t < nthreads; ++t)
+    {
+        for (const auto& header : thrdheaders[t])
+        {
+            headers.push_back(mystart + header.first);
+            hdrnewlines.push_back(newlinesbefore + thrdnewlines[t] + header.second);
+        }
     }
 
     /*
-     * All processors get a copy of the read counts.
+     * The last record of a processor ends where the first header of a
+     * following processor (or the file) begins.
      */
-    MPI_Bcast(readcounts.data(), nprocs, MPI_COUNT_TYPE, 0, comm);
+    std::vector<unsigned long long> firstheaders(3*nprocs);
+    unsigned long long myfirstheader[3] = {headers.empty()? ULLONG_MAX : static_cast<unsigned long long>(headers.front()),
+                                           headers.empty()? 0ULL : static_cast<unsigned long long>(hdrnewlines.front()),
+                                           static_cast<unsigned long long>(mynewlines)};
+
+    MPI_Allgather(myfirstheader, 3, MPI_UNSIGNED_LONG_LONG, firstheaders.data(), 3, MPI_UNSIGNED_LONG_LONG, comm);
+
+    MPI_Offset nextheader = filesize;
+    size_t nextnewlines = 0;
+
+    for (int i = 0; i < nprocs; ++i)
+        nextnewlines += firstheaders[3*i+2];
+
+    for (int i = nprocs-1; i > myrank; --i)
+    {
+        if (firstheaders[3*i] != ULLONG_MAX)
+        {
+            nextheader = firstheaders[3*i];
+            nextnewlines = firstheaders[3*i+1];
+        }
+    }
 
     /*
-     * And the read displacements.
+     * Header lines and first sequence lines of my last records can run past
+     * the end of my share. Those bytes are fetched on demand.
      */
-    readdispls.resize(nprocs);
-    std::exclusive_scan(readcounts.begin(), readcounts.end(), readdispls.begin(), static_cast<MPI_Count_t>(0));
+    std::string overflow;
+
+    auto getbyte = [&](MPI_Offset p) -> char { return p < myend? share[p - mystart] : overflow[p - myend]; };
+
+    auto findnewline = [&](MPI_Offset p) -> MPI_Offset
+    {
+        if (p < myend)
+        {
+            auto q = static_cast<char const*>(std::memchr(share + (p - mystart), '\n', myend - p));
+            if (q) return mystart + (q - share);
+            p = myend;
+        }
+
+        while (true)
+        {
+            size_t i = p - myend;
+
+            if (i < overflow.size())
+            {
+                auto q = static_cast<char const*>(std::memchr(overflow.data() + i, '\n', overflow.size() - i));
+                if (q) return myend + (q - overflow.data());
+                p = myend + overflow.size();
+            }
+
+            if (myend + static_cast<MPI_Offset>(overflow.size()) >= filesize)
+                return filesize;
+
+            size_t have = overflow.size();
+            size_t more = std::min(std::max(have, static_cast<size_t>(1 << 16)), static_cast<size_t>(filesize - myend - have));
+            overflow.resize(have + more);
+            read_at_chunked(fh, myend + have, &overflow[have], more);
+        }
+    };
+
+    std::vector<Record> records(headers.size());
+    std::vector<std::string> names(writefai? headers.size() : 0);
 
+    for (size_t i = 0; i < headers.size(); ++i)
+    {
+        MPI_Offset header = headers[i];
+        MPI_Offset next = i+1 < headers.size()? headers[i+1] : nextheader;
+        size_t nextnl = i+1 < headers.size()? hdrnewlines[i+1] : nextnewlines;
+        MPI_Offset hdrend = findnewline(header);
+        Record& record = records[i];
+
+        /*
+         * Sequence name is the header line up to the first whitespace. It
+         * is only needed here if we are writing the index out.
+         */
+        for (MPI_Offset p = header+1; writefai && p < hdrend; ++p)
+        {
+            char c = getbyte(p);
+            if (std::isspace(static_cast<unsigned char>(c))) break;
+            names[i].push_back(c);
+        }
+
+        record.pos = std::min(hdrend + 1, next);
+        record.len = hdrend < next? (next - record.pos) - (nextnl - hdrnewlines[i] - 1) : 0;
+        record.bases = record.len > 0? std::min(findnewline(record.pos), next) - record.pos : 0;
+        record.fileid = fileid;
+    }
+
+    MPI_File_close(&fh);
+
+    if (writefai)
+    {
+        writefaidx(fileid, records, names);
+    }
+
+    #if LOG_LEVEL >= 2
+    unsigned long long numrecords = records.size();
+    MPI_Allreduce(MPI_IN_PLACE, &numrecords, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    Logger logger(comm);
+    logger() << "no " << std::quoted(get_faidx_fname(fileid)) << ", indexed " << numrecords << " sequences in parallel";
+    if (writefai) logger() << " (index written to " << std::quoted(get_faidx_fname(fileid)) << ")";
+    logger.flush("Fasta index construction:", 0);
+    #endif
+
+    return records;
+}
+
+void FastaIndex::writefaidx(int fileid, const std::vector<Record>& records, const std::vector<std::string>& names) const
+{
     /*
-     * It is useful for the displacements to store the total number
-     * of reads in the last position.
+     * Same format as samtools faidx. Every processor writes the lines of
+     * its own records at an offset given by a prefix sum of line sizes.
      */
-    // std::cout<<"Counts:"<<readcounts.back()<<std::endl;
-    // std::cout<<"Displacements:"<<readdispls.back()<<std::endl;
+    std::ostringstream ss;
 
-    readdispls.push_back(readdispls.back() + readcounts.back());
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        ss << names[i] << "\t" << records[i].len << "\t" << records[i].pos << "\t" << records[i].bases << "\t" << records[i].bases+1 << "\n";
+    }
+
+    std::string mylines = ss.str();
+    MPI_Offset mysize = mylines.size();
+    MPI_Offset myoffset = 0;
+    MPI_Offset totsize;
+
+    MPI_Exscan(&mysize, &myoffset, 1, MPI_OFFSET, MPI_SUM, comm);
+    MPI_Allreduce(&mysize, &totsize, 1, MPI_OFFSET, MPI_SUM, comm);
+    if (myrank == 0) myoffset = 0;
+
+    MPI_File fh;
+
+    if (MPI_File_open(comm, get_faidx_fname(fileid).c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+        if (myrank == 0) std::cerr << "Warning: could not write " << std::quoted(get_faidx_fname(fileid)) << std::endl;
+        return;
+    }
+
+    MPI_File_set_size(fh, totsize);
+    write_at_all_chunked(fh, myoffset, mylines.data(), mysize, comm);
+    MPI_File_close(&fh);
+}
+
+void FastaIndex::getpartition(std::vector<Record>& records, std::vector<MPI_Count_t>& sendcounts) const
+{
+    assert(sendcounts.size() == (uint64_t)nprocs);
 
     /*
-     * To prevent confusion for the reader: the broadcasting of readcounts
-     * to every processor and the parallel "re"-computation of readdispls
-     * on each processor is not necessary for performing the scatter operation
-     * below, however we still do it because every processor will need to know
-     * those things later.
+     * Coming up with the optimal partitioning of sequences weighted by their length
+     * is NP-hard. It's basically a variation on multiway number partition, except
+     * where the divisions must be ordered. The following seems like a fine
+     * approximation, and needs no processor to see all the records: with a prefix
+     * sum of base counts every processor knows where its @records sit in the
+     * concatenation of all sequences, and each record goes to the processor whose
+     * 1/nprocs slice of that concatenation contains the record's midpoint. Record
+     * owners are therefore non-decreasing, so each processor still ends up with a
+     * contiguous range of reads.
+     *
+     * With several files the concatenation is file by file, so the prefix sums
+     * are done per file and offset by the total size of the files before.
      */
-    myrecords.resize(readcounts[myrank]);
+    int numfiles = getnumfiles();
+    std::vector<unsigned long long> mybases(numfiles, 0), basesbefore(numfiles, 0), filebases(numfiles);
+
+    for (const auto& record : records)
+        mybases[record.fileid] += record.len;
+
+    MPI_Exscan(mybases.data(), basesbefore.data(), numfiles, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    MPI_Allreduce(mybases.data(), filebases.data(), numfiles, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    if (myrank == 0) std::fill(basesbefore.begin(), basesbefore.end(), 0);
+
+    size_t totbases = 0;
+
+    for (int i = 0; i < numfiles; ++i)
+    {
+        basesbefore[i] += totbases;
+        totbases += filebases[i];
+    }
+
+    double avgbasesperproc = static_cast<double>(totbases) / nprocs;
 
     /*
-     * Each record is represented with three numbers (read length,
-     * FASTA position, FASTA line width), so we create an MPI datatype
-     * to communicate each record as a single unit.
+     * Whole records alone can't do better than the longest record, which is a
+     * problem for ultra-long reads or contigs. So a record that crosses a slice
+     * boundary is cut at the boundary, and the part before the cut is extended
+     * by KMER_SIZE-1 bases: the two pieces then overlap by exactly the bases
+     * needed for every k-mer to be counted once, by one of them. Cuts can be
+     * mid-line (such records are often written on a single line), in which
+     * case the piece after it remembers the column it starts at. No cut is
+     * made if the piece after it would hold no k-mers.
+     *
+     * Cuts are at multiples of 4 bases, so that without its overlap a piece
+     * is a whole number of bytes of its record's 2-bit encoding (which is how
+     * ReadCache stores pieces independently of KMER_SIZE).
      */
-    MPI_Datatype faidx_dtype_t;
-    MPI_Type_contiguous(3, MPI_UNSIGNED_LONG_LONG, &faidx_dtype_t); // Is this correct?
-    MPI_Type_commit(&faidx_dtype_t);
+    std::vector<Record> pieces;
+    pieces.reserve(records.size());
 
+    std::fill(sendcounts.begin(), sendcounts.end(), 0);
+
+    auto addpiece = [&](const Record& record, size_t start, size_t end, double globalstart)
+    {
+        Record piece = record;
+        piece.pos = start > 0? record.pos + start + start / record.bases : record.pos;
+        piece.len = std::min(end + KMER_SIZE - 1, record.len) - start;
+        piece.col = start > 0? start % record.bases : 0;
+        piece.overlap = piece.len - (end - start);
+
+        double midpoint = globalstart + (start + end) / 2.0;
+        int owner = avgbasesperproc > 0? std::min(nprocs-1, static_cast<int>(midpoint / avgbasesperproc)) : 0;
+        sendcounts[owner]++;
+        pieces.push_back(piece);
+    };
+
+    for (const auto& record : records)
+    {
+        double globalstart = basesbefore[record.fileid];
+        size_t start = 0;
+
+        if (record.bases > 0 && avgbasesperproc > 0)
+        {
+            int firstslice = static_cast<int>(globalstart / avgbasesperproc);
+            int lastslice = std::min(nprocs-1, static_cast<int>((globalstart + record.len) / avgbasesperproc));
+
+            for (int slice = firstslice + 1; slice <= lastslice; ++slice)
+            {
+                double boundary = slice * avgbasesperproc - globalstart;
+                size_t cut = static_cast<size_t>(std::llround(boundary / 4)) * 4;
+
+                if (cut <= start || cut + KMER_SIZE > record.len)
+                    continue;
+
+                addpiece(record, start, cut, globalstart);
+                start = cut;
+            }
+        }
+
+        addpiece(record, start, record.len, globalstart);
+
+        basesbefore[record.fileid] += record.len;
+    }
+
+    records.swap(pieces);
+}
+
+void FastaIndex::distribute(std::vector<Record>& records)
+{
     /*
-     * Scatter the records according to the load-balanced read partitioning.
+     * @records are this processor's share of all the records, and the shares
+     * are in processor order. Each record (or piece of one, after
+     * @getpartition has split the long ones) is sent to its owner.
      */
+    std::vector<MPI_Count_t> sendcounts(nprocs), recvcounts(nprocs);
+    std::vector<MPI_Offset_t> sdispls(nprocs), rdispls(nprocs);
+
+    getpartition(records, sendcounts);
+
+    MPI_Alltoall(sendcounts.data(), 1, MPI_COUNT_TYPE, recvcounts.data(), 1, MPI_COUNT_TYPE, comm);
 
-    MPI_Scatterv(rootrecords.data(), readcounts.data(), readdispls.data(), faidx_dtype_t, myrecords.data(), readcounts[myrank], faidx_dtype_t, 0, comm);
+    std::exclusive_scan(sendcounts.begin(), sendcounts.end(), sdispls.begin(), static_cast<MPI_Offset_t>(0));
+    std::exclusive_scan(recvcounts.begin(), recvcounts.end(), rdispls.begin(), static_cast<MPI_Offset_t>(0));
 
+    myrecords.resize(rdispls.back() + recvcounts.back());
+
+    MPI_Datatype faidx_dtype_t = create_faidx_dtype();
+    alltoallv_large(records.data(), sendcounts, sdispls, myrecords.data(), recvcounts, rdispls, faidx_dtype_t, comm);
     MPI_Type_free(&faidx_dtype_t);
 
+    /*
+     * Records come in grouped by sender. With several files that isn't file
+     * order anymore (a sender's records of the next file come before the next
+     * sender's records of this file), so put them back in order.
+     */
+    if (getnumfiles() > 1)
+    {
+        std::sort(myrecords.begin(), myrecords.end(), [](const Record& a, const Record& b) { return a.fileid < b.fileid || (a.fileid == b.fileid && a.pos < b.pos); });
+    }
 
-    #if LOG_LEVEL >= 2
-    Logger logger(comm);
-    size_t mytotbases = std::accumulate(myrecords.begin(), myrecords.end(), static_cast<size_t>(0), [](size_t sum, const auto& record) { return sum + record.len; });
-    size_t totbases;
-    MPI_Allreduce(&mytotbases, &totbases, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
-    double percent_proportion = (static_cast<double>(mytotbases) / totbases) * 100.0;
-    logger() << " is responsible for sequences " << Logger::readrangestr(readdispls[myrank], readcounts[myrank]) << " (" << mytotbases << " nucleotides, " << std::fixed << std::setprecision(3) << percent_proportion << "%)";
-    logger.flush("Fasta index construction:");
-    #endif
+    /*
+     * Every processor gets a copy of the read counts and displacements.
+     */
+    MPI_Count_t mycount = myrecords.size();
+    MPI_Allgather(&mycount, 1, MPI_COUNT_TYPE, readcounts.data(), 1, MPI_COUNT_TYPE, comm);
+
+    readdispls.resize(nprocs);
+    std::exclusive_scan(readcounts.begin(), readcounts.end(), readdispls.begin(), static_cast<MPI_Offset_t>(0));
+    readdispls.push_back(readdispls.back() + readcounts.back());
 }
 
 std::vector<size_t> FastaIndex::getmyreadlens() const
@@ -199,97 +592,356 @@ std::vector<size_t> FastaIndex::getmyreadlens() const
     return readlens;
 }
 
-DnaBuffer FastaIndex::getmydna() const
+std::vector<size_t> FastaIndex::getmyoverlaps() const
+{
+    std::vector<size_t> overlaps(getmyreadcount());
+    std::transform(myrecords.cbegin(), myrecords.cend(), overlaps.begin(), [](const auto& record) { return record.overlap; });
+    return overlaps;
+}
+
+std::vector<std::string> FastaIndex::getmyreadnames() const
 {
     /*
-     * Allocate local sequence buffer.
+     * Read names are not kept around after indexing, they are read back from
+     * the FASTA when asked for. Sequences are stored in file order, so the
+     * header line of each of my reads sits in the gap between the end of the
+     * previous read's sequence lines and the start of its own. The gaps in
+     * each file are read with a single collective call through an hindexed
+     * file view, without touching the sequence lines themselves. The gap of my
+     * first read in a file starts where the last read in that file of the
+     * nearest processor before me ends (or at the start of the file).
+     *
+     * A piece of a split record (see @getpartition) that isn't its first
+     * starts before the previous piece ends. It has no gap of its own and
+     * takes the record's name from the piece before it.
      */
-    auto readlens = getmyreadlens(); /* vector of local read lengths */
-    size_t bufsize = DnaBuffer::computebufsize(readlens); /* minimum number of bytes needed to 2-bit encode all the local reads */
-    DnaBuffer dnabuf(bufsize); /* initialize dnabuf by allocating @bufsize bytes */
-    size_t numreads = readlens.size(); /* number of local reads */
+    int numfiles = getnumfiles();
+    size_t numreads = myrecords.size();
+    std::vector<unsigned long long> mylastends(numfiles, 0), prevends(numfiles, 0);
 
-    MPI_Offset startpos; /* the FASTA position that starts my local chunk of reads */
-    MPI_Offset endpos; /* the FASTA position that ends my local chunk of reads (exclusive) */
-    MPI_Offset filesize; /* the total size of the FASTA */
-    MPI_Offset readbufsize; /* endpos - startpos */
-    MPI_File fh;
+    for (const auto& record : myrecords)
+        mylastends[record.fileid] = record_end(record);
+
+    MPI_Exscan(mylastends.data(), prevends.data(), numfiles, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+    if (myrank == 0) std::fill(prevends.begin(), prevends.end(), 0);
+
+    std::vector<int> gaplens(numreads);
+    std::vector<MPI_Aint> gapstarts(numreads);
+    std::vector<size_t> gapoffsets(numreads+1, 0);
+    std::vector<bool> continued(numreads, false);
+
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        unsigned long long& prevend = prevends[myrecords[i].fileid];
+        continued[i] = prevend > myrecords[i].pos;
+        gapstarts[i] = static_cast<MPI_Aint>(prevend);
+        gaplens[i] = continued[i]? 0 : static_cast<int>(myrecords[i].pos - prevend);
+        gapoffsets[i+1] = gapoffsets[i] + gaplens[i];
+        prevend = record_end(myrecords[i]);
+    }
+
+    std::unique_ptr<char[]> gaps(new char[gapoffsets.back()+1]);
+    size_t first = 0; /* my first record in the current file */
+
+    for (int fileid = 0; fileid < numfiles; ++fileid)
+    {
+        size_t last = first;
+        while (last < numreads && myrecords[last].fileid == static_cast<size_t>(fileid)) last++;
+
+        size_t filereads = last - first;
+        size_t totgap = gapoffsets[last] - gapoffsets[first];
+
+        MPI_File fh;
+        MPI_Datatype gap_dtype_t = MPI_CHAR;
+
+        MPI_File_open(comm, get_fasta_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+
+        if (filereads > 0)
+        {
+            MPI_Type_create_hindexed(static_cast<int>(filereads), &gaplens[first], &gapstarts[first], MPI_CHAR, &gap_dtype_t);
+            MPI_Type_commit(&gap_dtype_t);
+        }
+
+        MPI_File_set_view(fh, 0, MPI_CHAR, gap_dtype_t, "native", MPI_INFO_NULL);
+
+        /*
+         * Successive reads continue through the view where the last one stopped.
+         */
+        unsigned long long rounds = (totgap + max_mpi_count - 1) / max_mpi_count;
+        MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+
+        for (size_t r = 0, done = 0; r < rounds; ++r)
+        {
+            int cnt = static_cast<int>(std::min(totgap - done, max_mpi_count));
+            MPI_File_read_all(fh, &gaps[gapoffsets[first] + done], cnt, MPI_CHAR, MPI_STATUS_IGNORE);
+            done += cnt;
+        }
+
+        MPI_File_close(&fh);
+
+        if (filereads > 0)
+        {
+            MPI_Type_free(&gap_dtype_t);
+        }
+
+        first = last;
+    }
 
     /*
-     * FASTA file will be read using MPI collective I/O.
+     * A gap is whatever trails the previous sequence (its last newline) followed
+     * by the header line. The name is what follows the '>' up to the first whitespace.
      */
-    MPI_File_open(comm, get_fasta_fname().c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
-    MPI_File_get_size(fh, &filesize);
+    std::vector<std::string> names(numreads);
+
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        char const *gap = &gaps[gapoffsets[i]];
+        char const *gapend = gap + gaplens[i];
+        char const *p = static_cast<char const*>(std::memchr(gap, '>', gaplens[i]));
+
+        if (p)
+        {
+            char const *q = ++p;
+            while (q < gapend && !std::isspace(static_cast<unsigned char>(*q))) ++q;
+            names[i].assign(p, q);
+        }
+    }
 
     /*
-     * Get start and end coordinates within FASTA of the sequences
-     * this processor requires.
+     * Pieces continuing a record from before my first whole record get the
+     * name of the last whole record of the nearest processor before me.
      */
-    startpos = myrecords.front().pos;
-    endpos = myrecords.back().pos + myrecords.back().len + (myrecords.back().len / myrecords.back().bases);
-    if (endpos > filesize) endpos = filesize;
+    size_t firstwhole = 0;
+    while (firstwhole < numreads && continued[firstwhole]) firstwhole++;
 
+    std::string mylastname;
+    int mylastnamelen = -1; /* no whole records */
+
+    for (size_t i = numreads; i > 0; --i)
+    {
+        if (!continued[i-1])
+        {
+            mylastname = names[i-1];
+            mylastnamelen = static_cast<int>(mylastname.size());
+            break;
+        }
+    }
+
+    std::vector<int> lastnamelens(nprocs), lastnamedispls(nprocs);
+    MPI_Allgather(&mylastnamelen, 1, MPI_INT, lastnamelens.data(), 1, MPI_INT, comm);
+
+    std::vector<int> recvcounts(nprocs);
+    std::transform(lastnamelens.begin(), lastnamelens.end(), recvcounts.begin(), [](int len) { return std::max(len, 0); });
+    std::exclusive_scan(recvcounts.begin(), recvcounts.end(), lastnamedispls.begin(), 0);
+
+    std::string lastnames(lastnamedispls.back() + recvcounts.back(), '\0');
+    MPI_Allgatherv(mylastname.data(), std::max(mylastnamelen, 0), MPI_CHAR, &lastnames[0], recvcounts.data(), lastnamedispls.data(), MPI_CHAR, comm);
+
+    std::string prevname;
+
+    for (int i = myrank-1; i >= 0; --i)
+    {
+        if (lastnamelens[i] >= 0)
+        {
+            prevname = lastnames.substr(lastnamedispls[i], lastnamelens[i]);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        if (continued[i]) names[i] = i < firstwhole? prevname : names[i-1];
+    }
+
+    return names;
+}
+
+DnaBuffer FastaIndex::getmydna(InputMode mode) const
+{
     /*
-     * Allocate a char buffer to read my FASTA chunk into to,
-     * and then do the reading.
+     * Allocate local sequence buffer. Every read gets its slot (offset into the
+     * buffer) assigned up front so that reads can be encoded independently.
      */
-    readbufsize = endpos - startpos;
-    std::unique_ptr<char[]> readbuf(new char[readbufsize]);
+    auto readlens = getmyreadlens(); /* vector of local read lengths */
+    size_t bufsize = DnaBuffer::computebufsize(readlens); /* minimum number of bytes needed to 2-bit encode all the local reads */
+    size_t numreads = readlens.size(); /* number of local reads */
+    DnaBuffer dnabuf(bufsize, numreads, new uint8_t[bufsize], readlens.data());
 
     /*
-     * Every processor that calls @getmydna reads in its assigned chunk of data
-     * into its temporary local storage buffer (meant for raw contents of file).
+     * My reads are a contiguous run of records in file order, so in each file
+     * there is one chunk of the FASTA to get at. Each file is read with one
+     * collective call (in which processors with nothing to read from it
+     * still participate), or mapped if it has any of my reads.
      */
-    MPI_File_read_at_all(fh, startpos, &readbuf[0], readbufsize, MPI_CHAR, MPI_STATUS_IGNORE);
-    MPI_File_close(&fh);
+    int numfiles = getnumfiles();
+    std::vector<MPI_Offset> startpos(numfiles, 0); /* the FASTA position that starts my local chunk of reads in each file */
+    std::vector<char const*> chunks(numfiles, nullptr); /* raw contents of my FASTA chunk of each file, starting at @startpos */
+    std::vector<std::unique_ptr<char[]>> readbufs(numfiles); /* raw contents of my FASTA chunks (MPIIO) */
+    std::vector<std::pair<char*, size_t>> maps; /* page aligned starts and lengths of my mapped FASTA chunks (MMAP) */
+    size_t first = 0; /* my first record in the current file */
+
+    for (int fileid = 0; fileid < numfiles; ++fileid)
+    {
+        size_t last = first;
+        while (last < numreads && myrecords[last].fileid == static_cast<size_t>(fileid)) last++;
+
+        MPI_Offset endpos; /* the FASTA position that ends my local chunk of reads (exclusive) */
+        MPI_Offset filesize; /* the total size of the FASTA */
+        MPI_Offset readbufsize; /* endpos - startpos */
+        MPI_File fh;
+        int fd = -1;
+
+        if (mode == MMAP)
+        {
+            /*
+             * Every processor maps its own chunk, no collective I/O involved.
+             */
+            if (last == first) continue;
+
+            struct stat st;
+            fd = open(get_fasta_fname(fileid).c_str(), O_RDONLY);
+
+            if (fd == -1 || fstat(fd, &st) == -1)
+            {
+                std::cerr << "Error: could not open " << std::quoted(get_fasta_fname(fileid)) << ": " << std::strerror(errno) << std::endl;
+                MPI_Abort(comm, 1);
+            }
+
+            filesize = st.st_size;
+        }
+        else
+        {
+            /*
+             * FASTA file will be read using MPI collective I/O.
+             */
+            MPI_File_open(comm, get_fasta_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+            MPI_File_get_size(fh, &filesize);
+        }
+
+        /*
+         * Get start and end coordinates within FASTA of the sequences
+         * this processor requires.
+         */
+        if (last > first)
+        {
+            startpos[fileid] = myrecords[first].pos;
+            endpos = record_end(myrecords[last-1]);
+            if (endpos > filesize) endpos = filesize;
+        }
+        else
+        {
+            startpos[fileid] = endpos = 0;
+        }
+        readbufsize = endpos - startpos[fileid];
+
+        if (mode == MMAP)
+        {
+            /*
+             * mmap offsets have to be page aligned. The chunk is mostly walked
+             * forward (records are in file order), so ask the kernel to read ahead
+             * aggressively; MADV_SEQUENTIAL also lets it reclaim pages we're done
+             * with sooner. Nothing is dropped explicitly: threads take records
+             * dynamically, so there is no point behind which all are done, and
+             * the whole mapping goes once the chunk is encoded.
+             */
+            MPI_Offset pagesize = sysconf(_SC_PAGESIZE);
+            MPI_Offset mapstart = (startpos[fileid] / pagesize) * pagesize;
+            size_t maplen = readbufsize > 0? endpos - mapstart : 0;
+            char *mapaddr = nullptr;
+
+            if (maplen > 0)
+            {
+                mapaddr = static_cast<char*>(mmap(nullptr, maplen, PROT_READ, MAP_PRIVATE, fd, mapstart));
+
+                if (mapaddr == MAP_FAILED)
+                {
+                    std::cerr << "Error: could not mmap " << std::quoted(get_fasta_fname(fileid)) << ": " << std::strerror(errno) << std::endl;
+                    MPI_Abort(comm, 1);
+                }
+
+                madvise(mapaddr, maplen, MADV_SEQUENTIAL);
+                madvise(mapaddr, maplen, MADV_WILLNEED);
+                maps.emplace_back(mapaddr, maplen);
+            }
+
+            close(fd);
+
+            chunks[fileid] = mapaddr + (startpos[fileid] - mapstart);
+        }
+        else
+        {
+            /*
+             * Allocate a char buffer to read my FASTA chunk into to,
+             * and then do the reading.
+             */
+            readbufs[fileid].reset(new char[readbufsize]);
+
+            /*
+             * Every processor that calls @getmydna reads in its assigned chunk of data
+             * into its temporary local storage buffer (meant for raw contents of file).
+             */
+            read_at_all_chunked(fh, startpos[fileid], &readbufs[fileid][0], readbufsize, comm);
+            MPI_File_close(&fh);
+
+            chunks[fileid] = &readbufs[fileid][0];
+        }
+
+        first = last;
+    }
 
     size_t totbases = std::accumulate(readlens.begin(), readlens.end(), static_cast<size_t>(0), std::plus<size_t>{});
-    size_t maxlen = *std::max_element(readlens.begin(), readlens.end());
 
-    /*
-     * ASCII sequences are first read into this temporary char buffer
-     * before they are compressed into the sequence buffer.
-     */
-    std::unique_ptr<char[]> tmpbuf(new char[maxlen]);
+    int nthreads = omp_get_max_threads();
+    std::vector<size_t> thrdbases(nthreads, 0);
+    std::vector<double> thrdtimes(nthreads, 0);
 
     MPI_Barrier(comm);
     double elapsed = -MPI_Wtime();
 
-    /*
-     * Go through each local FASTA record.
-     */
-    for (auto itr = myrecords.cbegin(); itr != myrecords.cend(); ++itr)
+    #pragma omp parallel num_threads(nthreads)
     {
-        size_t locpos = 0;
-        ptrdiff_t chunkpos = itr->pos - startpos;
-        ptrdiff_t remain = itr->len;
-        char *writeptr = &tmpbuf[0];
+        int tid = omp_get_thread_num();
+        double thrdelapsed = -omp_get_wtime();
+        size_t mybases = 0; /* written out once, neighbouring threads share cache lines */
 
         /*
-         * Read ASCII FASTA sequence into the temoprary buffer.
+         * Go through each local FASTA record. Read lengths vary a lot,
+         * so records are handed out dynamically. No barrier after the loop,
+         * so that every thread times its own records only (the end of the
+         * parallel region waits for all of them).
          */
-        while (remain > 0)
+        #pragma omp for schedule(dynamic, 64) nowait
+        for (size_t i = 0; i < numreads; ++i)
         {
-            size_t cnt = std::min(itr->bases, static_cast<size_t>(remain));
-            std::memcpy(writeptr, &readbuf[chunkpos + locpos], cnt);
-            writeptr += cnt;
-            remain -= cnt;
-            locpos += (cnt+1);
+            const Record& record = myrecords[i];
+
+            /*
+             * DnaBuffer 2-bit encodes the ASCII sequence, line by line, straight
+             * from the file contents into the slot reserved for read @i.
+             */
+            dnabuf.fill(i, chunks[record.fileid] + (record.pos - startpos[record.fileid]), record.bases, record.col);
+            mybases += record.len;
         }
 
-        /*
-         * DnaBuffer automatically 2-bit encodes the ASCII sequence
-         * and pushes it onto its local stack of sequences.
-         */
-        dnabuf.push_back(&tmpbuf[0], itr->len);
+        thrdelapsed += omp_get_wtime();
+        thrdbases[tid] = mybases;
+        thrdtimes[tid] = thrdelapsed;
     }
 
     elapsed += MPI_Wtime();
 
+    for (const auto& map : maps)
+    {
+        munmap(map.first, map.second);
+    }
+
     #if LOG_LEVEL >= 2
     double mbspersecond = (totbases / 1048576.0) / elapsed;
     Logger logger(comm);
-    logger() << std::fixed << std::setprecision(2) << mbspersecond << " Mbs/second";
+    logger() << std::fixed << std::setprecision(2) << mbspersecond << " Mbs/second (" << nthreads << " threads:";
+    for (int i = 0; i < nthreads; ++i)
+        logger() << " " << (thrdbases[i] / 1048576.0) / thrdtimes[i];
+    logger() << " Mbs/second/thread)";
     logger.flush("FASTA parsing rates (DnaBuffer):");
     #endif
 
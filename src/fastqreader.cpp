@@ -0,0 +1,243 @@
+#include "fastqreader.hpp"
+#include "logger.hpp"
+#include "fileio.hpp"
+#include <algorithm>
+#include <numeric>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <mpi.h>
+#include <omp.h>
+#include <sys/stat.h>
+
+FastqReader::FastqReader(const std::vector<std::string>& fastq_fnames, MPI_Comm comm) : comm(comm), fastq_fnames(fastq_fnames)
+{
+    MPI_Comm_size(comm, &nprocs);
+    MPI_Comm_rank(comm, &myrank);
+    readcounts.resize(nprocs, 0);
+    readdispls.resize(nprocs+1, 0);
+}
+
+bool FastqReader::isfastq(const std::string& fname, MPI_Comm comm)
+{
+    int myrank;
+    int fastq = 0;
+
+    MPI_Comm_rank(comm, &myrank);
+
+    if (myrank == 0)
+    {
+        char c;
+        std::ifstream filestream(fname);
+        fastq = filestream.get(c) && c == '@';
+    }
+
+    MPI_Bcast(&fastq, 1, MPI_INT, 0, comm);
+    return fastq;
+}
+
+void FastqReader::readshare(int fileid, MPI_Offset mystart, MPI_Offset myend, std::string& contents, std::vector<std::pair<size_t, size_t>>& records) const
+{
+    MPI_File fh;
+    MPI_Offset filesize;
+
+    MPI_File_open(comm, get_fastq_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+    MPI_File_get_size(fh, &filesize);
+
+    /*
+     * Read my share [mystart..myend) of the FASTQ with collective MPI-IO, plus
+     * the byte just before it so that we know whether the share begins at the
+     * start of a line. Processors with an empty share read nothing but still
+     * take part in the collective.
+     */
+    MPI_Offset readstart = mystart > 0 && mystart < myend? mystart-1 : mystart;
+
+    contents.assign(myend - readstart, '\0');
+    read_at_all_chunked(fh, readstart, &contents[0], myend - readstart, comm);
+
+    if (mystart == myend)
+    {
+        MPI_File_close(&fh);
+        return;
+    }
+
+    /*
+     * My last record (and the lines needed to recognize my first one) can run
+     * past the end of my share. Those bytes are fetched on demand. Returns the
+     * position of the first newline at or after @p, or the end of the file.
+     */
+    auto findnewline = [&](size_t p) -> size_t
+    {
+        size_t nl;
+
+        while ((nl = contents.find('\n', p)) == std::string::npos && readstart + static_cast<MPI_Offset>(contents.size()) < filesize)
+        {
+            size_t have = contents.size();
+            size_t more = std::min(static_cast<size_t>(1 << 16), static_cast<size_t>(filesize - readstart - have));
+            contents.resize(have + more);
+            read_at_chunked(fh, readstart + have, &contents[have], more);
+            p = have;
+        }
+
+        return nl == std::string::npos? contents.size() : nl;
+    };
+
+    /*
+     * Try to read a record starting at line start @p. A quality line can
+     * start with '@' too, so an '@' alone doesn't make a header: we also want
+     * the third line to be the '+' separator and the sequence and quality
+     * lines to have the same length. Gives the sequence position and length,
+     * and where the next record starts.
+     */
+    auto getrecord = [&](size_t p, size_t& seq, size_t& seqlen, size_t& next) -> bool
+    {
+        if (p >= contents.size() || contents[p] != '@') return false;
+
+        size_t hdrend = findnewline(p);
+        if (hdrend >= contents.size()) return false;
+
+        seq = hdrend+1;
+        size_t seqend = findnewline(seq);
+        if (seqend+1 >= contents.size() || contents[seqend+1] != '+') return false;
+
+        size_t plusend = findnewline(seqend+1);
+        if (plusend >= contents.size()) return false;
+
+        size_t qual = plusend+1;
+        size_t qualend = findnewline(qual);
+
+        seqlen = seqend - seq;
+        size_t quallen = qualend - qual;
+
+        if (seqlen > 0 && contents[seqend-1] == '\r') seqlen--;
+        if (quallen > 0 && contents[qualend-1] == '\r') quallen--;
+
+        next = qualend+1;
+        return seqlen == quallen;
+    };
+
+    size_t shareend = myend - readstart;
+    size_t p = mystart - readstart;
+
+    /*
+     * Skip ahead to the first record that starts inside my share. The one
+     * before it belongs to the previous processor.
+     */
+    if (mystart > 0)
+    {
+        size_t seq, seqlen, next;
+
+        if (contents[0] != '\n')
+            p = findnewline(p) + 1;
+
+        while (p < shareend && !getrecord(p, seq, seqlen, next))
+            p = findnewline(p) + 1;
+    }
+
+    while (p < shareend)
+    {
+        size_t seq, seqlen, next;
+
+        if (contents[p] == '\n' || contents[p] == '\r')
+        {
+            p = findnewline(p) + 1;
+            continue;
+        }
+
+        if (!getrecord(p, seq, seqlen, next))
+        {
+            std::cerr << "Error: malformed FASTQ record at byte " << readstart + p << " of " << std::quoted(get_fastq_fname(fileid)) << std::endl;
+            MPI_Abort(comm, 1);
+        }
+
+        records.emplace_back(seq, seqlen);
+        p = next;
+    }
+
+    MPI_File_close(&fh);
+}
+
+DnaBuffer FastqReader::getmydna()
+{
+    /*
+     * Files are split as if they were concatenated in the given order: every
+     * processor gets an equal share [mystart..myend) of the total size, which
+     * can span file boundaries, and reads its part of each file with one
+     * collective call.
+     */
+    int numfiles = getnumfiles();
+    std::vector<long long> filesizes(numfiles, 0);
+
+    if (myrank == 0)
+    {
+        for (int i = 0; i < numfiles; ++i)
+        {
+            struct stat st;
+            if (stat(get_fastq_fname(i).c_str(), &st) == 0) filesizes[i] = st.st_size;
+        }
+    }
+
+    MPI_Bcast(filesizes.data(), numfiles, MPI_LONG_LONG, 0, comm);
+
+    MPI_Offset totsize = std::accumulate(filesizes.begin(), filesizes.end(), static_cast<MPI_Offset>(0));
+    MPI_Offset mystart = (totsize * myrank) / nprocs;
+    MPI_Offset myend = (totsize * (myrank+1)) / nprocs;
+    MPI_Offset fileoffset = 0;
+
+    std::vector<std::string> contents(numfiles);
+    std::vector<std::vector<std::pair<size_t, size_t>>> records(numfiles); /* (sequence position in @contents, sequence length) */
+
+    for (int i = 0; i < numfiles; ++i)
+    {
+        MPI_Offset filestart = std::clamp(mystart - fileoffset, static_cast<MPI_Offset>(0), static_cast<MPI_Offset>(filesizes[i]));
+        MPI_Offset fileend = std::clamp(myend - fileoffset, static_cast<MPI_Offset>(0), static_cast<MPI_Offset>(filesizes[i]));
+        readshare(i, filestart, fileend, contents[i], records[i]);
+        fileoffset += filesizes[i];
+    }
+
+    std::vector<std::pair<char const*, size_t>> reads; /* (sequence, length), in file order */
+
+    for (int i = 0; i < numfiles; ++i)
+    {
+        for (const auto& record : records[i])
+            reads.emplace_back(contents[i].data() + record.first, record.second);
+    }
+
+    /*
+     * Every processor gets a copy of the read counts and displacements.
+     */
+    MPI_Count_t mycount = reads.size();
+    MPI_Allgather(&mycount, 1, MPI_COUNT_TYPE, readcounts.data(), 1, MPI_COUNT_TYPE, comm);
+
+    std::exclusive_scan(readcounts.begin(), readcounts.end(), readdispls.begin(), static_cast<MPI_Offset_t>(0));
+    readdispls.back() = readdispls[nprocs-1] + readcounts.back();
+
+    /*
+     * Sequence lines are not wrapped, so each read is 2-bit encoded
+     * straight from the file contents into its slot.
+     */
+    size_t numreads = reads.size();
+    std::vector<size_t> readlens(numreads);
+    std::transform(reads.cbegin(), reads.cend(), readlens.begin(), [](const auto& read) { return read.second; });
+
+    size_t bufsize = DnaBuffer::computebufsize(readlens);
+    DnaBuffer dnabuf(bufsize, numreads, new uint8_t[bufsize], readlens.data());
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        dnabuf.fill(i, reads[i].first);
+    }
+
+    #if LOG_LEVEL >= 2
+    Logger logger(comm);
+    size_t mytotbases = std::accumulate(readlens.begin(), readlens.end(), static_cast<size_t>(0));
+    size_t totbases;
+    MPI_Allreduce(&mytotbases, &totbases, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    double percent_proportion = (static_cast<double>(mytotbases) / totbases) * 100.0;
+    logger() << " is responsible for sequences " << Logger::readrangestr(readdispls[myrank], readcounts[myrank]) << " (" << mytotbases << " nucleotides, " << std::fixed << std::setprecision(3) << percent_proportion << "%)";
+    logger.flush("FASTQ parsing:");
+    #endif
+
+    return dnabuf;
+}
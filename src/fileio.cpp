@@ -0,0 +1,98 @@
+#include "fileio.hpp"
+#include <algorithm>
+#include <climits>
+
+void read_at_chunked(MPI_File fh, MPI_Offset pos, char *buf, size_t count)
+{
+    while (count > 0)
+    {
+        int cnt = static_cast<int>(std::min(count, max_mpi_count));
+        MPI_File_read_at(fh, pos, buf, cnt, MPI_CHAR, MPI_STATUS_IGNORE);
+        pos += cnt;
+        buf += cnt;
+        count -= cnt;
+    }
+}
+
+void read_at_all_chunked(MPI_File fh, MPI_Offset pos, char *buf, size_t count, MPI_Comm comm)
+{
+    unsigned long long rounds = (count + max_mpi_count - 1) / max_mpi_count;
+    MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+
+    for (unsigned long long r = 0; r < rounds; ++r)
+    {
+        int cnt = static_cast<int>(std::min(count, max_mpi_count));
+        MPI_File_read_at_all(fh, pos, buf, cnt, MPI_CHAR, MPI_STATUS_IGNORE);
+        pos += cnt;
+        buf += cnt;
+        count -= cnt;
+    }
+}
+
+void write_at_all_chunked(MPI_File fh, MPI_Offset pos, char const *buf, size_t count, MPI_Comm comm)
+{
+    unsigned long long rounds = (count + max_mpi_count - 1) / max_mpi_count;
+    MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+
+    for (unsigned long long r = 0; r < rounds; ++r)
+    {
+        int cnt = static_cast<int>(std::min(count, max_mpi_count));
+        MPI_File_write_at_all(fh, pos, buf, cnt, MPI_CHAR, MPI_STATUS_IGNORE);
+        pos += cnt;
+        buf += cnt;
+        count -= cnt;
+    }
+}
+
+void alltoallv_large(const void *sendbuf, const std::vector<MPI_Count_t>& sendcounts, const std::vector<MPI_Offset_t>& sdispls,
+                     void *recvbuf, const std::vector<MPI_Count_t>& recvcounts, const std::vector<MPI_Offset_t>& rdispls,
+                     MPI_Datatype dtype, MPI_Comm comm)
+{
+    int nprocs;
+    MPI_Comm_size(comm, &nprocs);
+
+    long long largest = 0;
+
+    for (int i = 0; i < nprocs; ++i)
+    {
+        largest = std::max({largest, static_cast<long long>(sdispls[i] + sendcounts[i]), static_cast<long long>(rdispls[i] + recvcounts[i])});
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, &largest, 1, MPI_LONG_LONG, MPI_MAX, comm);
+
+    if (largest <= INT_MAX)
+    {
+        std::vector<int> scounts(sendcounts.begin(), sendcounts.end()), sdispls32(sdispls.begin(), sdispls.end());
+        std::vector<int> rcounts(recvcounts.begin(), recvcounts.end()), rdispls32(rdispls.begin(), rdispls.end());
+        MPI_Alltoallv(sendbuf, scounts.data(), sdispls32.data(), dtype, recvbuf, rcounts.data(), rdispls32.data(), dtype, comm);
+        return;
+    }
+
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(dtype, &lb, &extent);
+
+    std::vector<MPI_Request> requests;
+
+    auto post = [&](char *buf, MPI_Count_t count, int peer, bool send)
+    {
+        for (MPI_Count_t done = 0; done < count; done += max_mpi_count)
+        {
+            int cnt = static_cast<int>(std::min(static_cast<size_t>(count - done), max_mpi_count));
+            requests.emplace_back();
+            if (send) MPI_Isend(buf + done*extent, cnt, dtype, peer, 0, comm, &requests.back());
+            else MPI_Irecv(buf + done*extent, cnt, dtype, peer, 0, comm, &requests.back());
+        }
+    };
+
+    for (int i = 0; i < nprocs; ++i)
+    {
+        post(static_cast<char*>(recvbuf) + rdispls[i]*extent, recvcounts[i], i, false);
+    }
+
+    for (int i = 0; i < nprocs; ++i)
+    {
+        post(const_cast<char*>(static_cast<char const*>(sendbuf)) + sdispls[i]*extent, sendcounts[i], i, true);
+    }
+
+    MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+}
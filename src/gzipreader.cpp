@@ -0,0 +1,610 @@
+#include "gzipreader.hpp"
+#include "fastaindex.hpp"
+#include "logger.hpp"
+#include "fileio.hpp"
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <climits>
+#include <iostream>
+#include <iomanip>
+#include <mpi.h>
+#include <omp.h>
+#include <zlib.h>
+
+using Record = typename FastaIndex::Record;
+
+/*
+ * Size of the BGZF block starting at @p (header, compressed data and footer),
+ * or 0 if @p isn't the start of a gzip member carrying the BGZF 'BC' extra
+ * subfield. @n is the number of bytes available at @p.
+ */
+static size_t bgzf_block_size(const uint8_t *p, size_t n)
+{
+    if (n < 18 || p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4))
+        return 0;
+
+    size_t xlen = p[10] | (p[11] << 8);
+
+    if (n < 12 + xlen)
+        return 0;
+
+    for (size_t i = 12; i + 4 <= 12 + xlen; )
+    {
+        size_t slen = p[i+2] | (p[i+3] << 8);
+
+        if (p[i] == 'B' && p[i+1] == 'C' && slen == 2 && i + 6 <= 12 + xlen)
+            return (p[i+4] | (p[i+5] << 8)) + 1;
+
+        i += 4 + slen;
+    }
+
+    return 0;
+}
+
+/*
+ * Position of the first newline at or after @q in @s (@n bytes), or @n.
+ */
+static size_t line_end(char const *s, size_t n, size_t q)
+{
+    auto nl = static_cast<char const*>(std::memchr(s + q, '\n', n - q));
+    return nl? nl - s : n;
+}
+
+/*
+ * Whether a FASTQ record starts at line start @p of @s (@n bytes), with the
+ * same checks as FastqReader: an '@' line, followed two lines later by the
+ * '+' separator, and sequence and quality lines of equal length. Lines must
+ * end inside @s, except for the quality line when @s ends the input (@atend).
+ */
+static bool fastq_record_at(char const *s, size_t n, size_t p, bool atend, Record& record, size_t& next)
+{
+    if (p >= n || s[p] != '@') return false;
+
+    size_t hdrend = line_end(s, n, p);
+    if (hdrend >= n) return false;
+
+    size_t seq = hdrend+1;
+    size_t seqend = line_end(s, n, seq);
+    if (seqend+1 >= n || s[seqend+1] != '+') return false;
+
+    size_t plusend = line_end(s, n, seqend+1);
+    if (plusend >= n) return false;
+
+    size_t qual = plusend+1;
+    size_t qualend = line_end(s, n, qual);
+    if (qualend >= n && !atend) return false;
+
+    size_t seqlen = seqend - seq;
+    size_t quallen = qualend - qual;
+
+    if (seqlen > 0 && s[seqend-1] == '\r') seqlen--;
+    if (quallen > 0 && s[qualend-1] == '\r') quallen--;
+
+    record.pos = seq;
+    record.len = seqlen;
+    record.bases = seqlen; /* one line */
+    next = qualend+1;
+
+    return seqlen == quallen;
+}
+
+/*
+ * Index the FASTA records in @s (@n bytes), which holds whole records.
+ * Positions are relative to @s, and records have the same meaning as
+ * FASTA index records.
+ */
+static std::vector<Record> index_fasta(char const *s, size_t n)
+{
+    std::vector<Record> records;
+    size_t p = 0;
+
+    while (p < n)
+    {
+        if (s[p] != '>')
+        {
+            p = line_end(s, n, p) + 1;
+            continue;
+        }
+
+        Record record;
+        record.pos = std::min(line_end(s, n, p) + 1, n);
+        record.bases = 0;
+
+        size_t q = record.pos;
+        size_t newlines = 0;
+
+        while (q < n && s[q] != '>')
+        {
+            size_t e = line_end(s, n, q);
+            if (newlines == 0) record.bases = e - q;
+            newlines += (e < n);
+            q = e+1;
+        }
+
+        q = std::min(q, n);
+        record.len = (q - record.pos) - newlines;
+        records.push_back(record);
+        p = q;
+    }
+
+    return records;
+}
+
+GzipReader::GzipReader(const std::vector<std::string>& gz_fnames, MPI_Comm comm) : comm(comm), gz_fnames(gz_fnames)
+{
+    MPI_Comm_size(comm, &nprocs);
+    MPI_Comm_rank(comm, &myrank);
+    readcounts.resize(nprocs, 0);
+    readdispls.resize(nprocs+1, 0);
+
+    /*
+     * A BGZF file starts with a BGZF block, plain gzip doesn't.
+     * The root also gets the file sizes while at it.
+     */
+    int numfiles = getnumfiles();
+    bgzf.resize(numfiles, 0);
+    filesizes.resize(numfiles, 0);
+
+    if (myrank == 0)
+    {
+        for (int i = 0; i < numfiles; ++i)
+        {
+            MPI_File fh;
+            MPI_Offset filesize;
+            MPI_File_open(MPI_COMM_SELF, gz_fnames[i].c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+            MPI_File_get_size(fh, &filesize);
+            filesizes[i] = filesize;
+
+            std::vector<uint8_t> head(std::min(filesizes[i], static_cast<long long>(1 << 16)));
+            read_at_chunked(fh, 0, reinterpret_cast<char*>(head.data()), head.size());
+            MPI_File_close(&fh);
+
+            bgzf[i] = bgzf_block_size(head.data(), head.size()) > 0;
+        }
+    }
+
+    MPI_Bcast(bgzf.data(), numfiles, MPI_INT, 0, comm);
+    MPI_Bcast(filesizes.data(), numfiles, MPI_LONG_LONG, 0, comm);
+}
+
+bool GzipReader::isgzip(const std::string& fname, MPI_Comm comm)
+{
+    int myrank;
+    int gzip = 0;
+
+    MPI_Comm_rank(comm, &myrank);
+
+    if (myrank == 0)
+    {
+        unsigned char magic[2] = {0, 0};
+        FILE *f = fopen(fname.c_str(), "rb");
+
+        if (f)
+        {
+            gzip = fread(magic, 1, 2, f) == 2 && magic[0] == 31 && magic[1] == 139;
+            fclose(f);
+        }
+    }
+
+    MPI_Bcast(&gzip, 1, MPI_INT, 0, comm);
+    return gzip;
+}
+
+std::string GzipReader::inflatebgzf(int fileid, MPI_Offset mystart, MPI_Offset myend) const
+{
+    MPI_File fh;
+    MPI_Offset filesize = filesizes[fileid];
+
+    MPI_File_open(comm, get_gz_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+
+    /*
+     * Every processor takes the blocks that start in its share [mystart..myend)
+     * of the file. A block is at most 64 KB, so the last one ends within 64 KB
+     * past the share, and we read a bit more than that so that a candidate block
+     * header can be confirmed by the header of the block following it.
+     */
+    MPI_Offset readend = mystart < myend? std::min(filesize, myend + (1 << 16) + 18) : mystart;
+
+    std::vector<uint8_t> buf(readend - mystart);
+    read_at_all_chunked(fh, mystart, reinterpret_cast<char*>(buf.data()), buf.size(), comm);
+    MPI_File_close(&fh);
+
+    size_t n = buf.size();
+    size_t sharelen = myend - mystart;
+
+    auto confirmed = [&](size_t p) -> bool
+    {
+        size_t bsize = bgzf_block_size(buf.data() + p, n - p);
+        if (bsize == 0 || p + bsize > n) return false;
+        return mystart + static_cast<MPI_Offset>(p + bsize) == filesize || bgzf_block_size(buf.data() + p + bsize, n - p - bsize) > 0;
+    };
+
+    /*
+     * Find my first block (compressed data can contain the magic bytes by
+     * chance, hence the confirmation), then walk the blocks by their sizes.
+     */
+    size_t p = 0;
+
+    while (p < sharelen && !confirmed(p))
+    {
+        auto q = static_cast<const uint8_t*>(std::memchr(buf.data() + p + 1, 31, sharelen - p - 1));
+        p = q? q - buf.data() : sharelen;
+    }
+
+    std::vector<std::pair<size_t, size_t>> blocks; /* (position in @buf, block size) */
+
+    while (p < sharelen)
+    {
+        size_t bsize = bgzf_block_size(buf.data() + p, n - p);
+
+        if (bsize == 0 || p + bsize > n)
+        {
+            std::cerr << "Error: corrupt BGZF block at byte " << mystart + p << " of " << std::quoted(get_gz_fname(fileid)) << std::endl;
+            MPI_Abort(comm, 1);
+        }
+
+        blocks.emplace_back(p, bsize);
+        p += bsize;
+    }
+
+    /*
+     * Each block's footer has its uncompressed size, so every block knows
+     * where its output goes and threads can inflate blocks independently.
+     */
+    size_t numblocks = blocks.size();
+    std::vector<size_t> outoffsets(numblocks+1, 0);
+
+    for (size_t i = 0; i < numblocks; ++i)
+    {
+        const uint8_t *footer = &buf[blocks[i].first + blocks[i].second - 4];
+        outoffsets[i+1] = outoffsets[i] + (footer[0] | (footer[1] << 8) | (footer[2] << 16) | (static_cast<size_t>(footer[3]) << 24));
+    }
+
+    std::string stream(outoffsets.back(), '\0');
+    int failed = 0;
+
+    #pragma omp parallel
+    {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -15); /* raw deflate, we skip over the gzip header ourselves */
+
+        /*
+         * A block must inflate to exactly its ISIZE bytes (so even the empty
+         * EOF marker block is inflated), and those must match its CRC32.
+         */
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i < numblocks; ++i)
+        {
+            const uint8_t *block = &buf[blocks[i].first];
+            const uint8_t *footer = block + blocks[i].second - 8;
+            size_t xlen = block[10] | (block[11] << 8);
+            size_t isize = outoffsets[i+1] - outoffsets[i];
+            uLong crc = footer[0] | (footer[1] << 8) | (footer[2] << 16) | (static_cast<uLong>(footer[3]) << 24);
+            Bytef *out = reinterpret_cast<Bytef*>(&stream[0]) + outoffsets[i];
+
+            inflateReset(&zs);
+            zs.next_in = const_cast<Bytef*>(block + 12 + xlen);
+            zs.avail_in = static_cast<uInt>(blocks[i].second - xlen - 20);
+            zs.next_out = out;
+            zs.avail_out = static_cast<uInt>(isize);
+
+            if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0 || crc32(crc32(0L, Z_NULL, 0), out, static_cast<uInt>(isize)) != crc)
+            {
+                #pragma omp atomic write
+                failed = 1;
+            }
+        }
+
+        inflateEnd(&zs);
+    }
+
+    if (failed)
+    {
+        std::cerr << "Error: could not inflate BGZF blocks of " << std::quoted(get_gz_fname(fileid)) << std::endl;
+        MPI_Abort(comm, 1);
+    }
+
+    return stream;
+}
+
+std::string GzipReader::inflategzip(int fileid, int root) const
+{
+    MPI_File fh;
+    std::string stream;
+
+    MPI_File_open(comm, get_gz_fname(fileid).c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh);
+
+    if (myrank == root)
+    {
+        std::vector<uint8_t> buf(filesizes[fileid]);
+        read_at_chunked(fh, 0, reinterpret_cast<char*>(buf.data()), buf.size());
+
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, 15 + 16); /* gzip wrapper */
+
+        size_t consumed = 0;
+        int ret = Z_OK;
+        bool inmember = false;
+
+        while (consumed < buf.size())
+        {
+            /*
+             * Output grows as needed. Concatenated gzip members are inflated
+             * one after the other, and the input must not stop inside one.
+             * zlib checks every member's CRC32 and ISIZE.
+             */
+            if (stream.size() - zs.total_out < (1 << 20))
+                stream.resize(std::max(stream.size() * 2, static_cast<size_t>(1 << 22)));
+
+            size_t have = zs.total_out;
+            zs.next_in = buf.data() + consumed;
+            zs.avail_in = static_cast<uInt>(std::min(buf.size() - consumed, static_cast<size_t>(UINT_MAX)));
+            zs.next_out = reinterpret_cast<Bytef*>(&stream[have]);
+            zs.avail_out = static_cast<uInt>(std::min(stream.size() - have, static_cast<size_t>(UINT_MAX)));
+
+            size_t availin = zs.avail_in;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            consumed += availin - zs.avail_in;
+
+            if (ret == Z_STREAM_END)
+            {
+                size_t total = zs.total_out;
+                inflateReset(&zs);
+                zs.total_out = total;
+                inmember = false;
+            }
+            else if (ret != Z_OK)
+            {
+                break;
+            }
+            else
+            {
+                inmember = true;
+            }
+        }
+
+        inflateEnd(&zs);
+
+        /*
+         * An empty file has no members and gives no records.
+         */
+        if ((ret != Z_OK && ret != Z_STREAM_END) || inmember)
+        {
+            std::cerr << "Error: could not inflate " << std::quoted(get_gz_fname(fileid)) << std::endl;
+            MPI_Abort(comm, 1);
+        }
+
+        stream.resize(zs.total_out);
+    }
+
+    MPI_File_close(&fh);
+    return stream;
+}
+
+std::string GzipReader::gatherrecords(const std::string& stream, bool& fastq) const
+{
+    /*
+     * Processors hold consecutive pieces of the uncompressed stream, and a
+     * record belongs to the processor whose piece holds its first byte.
+     * Everyone shares the size and the first and last byte of their piece.
+     */
+    unsigned long long mypiece[3] = {stream.size(),
+                                     stream.empty()? 0ULL : static_cast<unsigned char>(stream.front()),
+                                     stream.empty()? 0ULL : static_cast<unsigned char>(stream.back())};
+
+    std::vector<unsigned long long> pieces(3*nprocs);
+    MPI_Allgather(mypiece, 3, MPI_UNSIGNED_LONG_LONG, pieces.data(), 3, MPI_UNSIGNED_LONG_LONG, comm);
+
+    std::vector<unsigned long long> offsets(nprocs+1, 0);
+
+    for (int i = 0; i < nprocs; ++i)
+        offsets[i+1] = offsets[i] + pieces[3*i];
+
+    int firstnonempty = 0, lastnonempty = nprocs-1;
+    while (firstnonempty < nprocs-1 && pieces[3*firstnonempty] == 0) firstnonempty++;
+    while (lastnonempty > 0 && pieces[3*lastnonempty] == 0) lastnonempty--;
+
+    fastq = pieces[3*firstnonempty+1] == '@';
+
+    /*
+     * Does my piece begin at the start of a line?
+     */
+    bool linestart = true;
+
+    for (int i = myrank-1; i >= 0; --i)
+    {
+        if (pieces[3*i] > 0)
+        {
+            linestart = pieces[3*i+2] == '\n';
+            break;
+        }
+    }
+
+    /*
+     * Find the first record start in my piece. FASTQ records are only
+     * accepted if they can be checked within my piece; a record that can't
+     * is left to the processor before me, which parses sequentially past
+     * the end of its piece anyway.
+     */
+    char const *s = stream.data();
+    size_t n = stream.size();
+    size_t p = linestart? 0 : line_end(s, n, 0) + 1;
+    unsigned long long myfirst = ULLONG_MAX;
+
+    while (p < n)
+    {
+        Record record;
+        size_t next;
+
+        if (fastq? fastq_record_at(s, n, p, myrank == lastnonempty, record, next) : s[p] == '>')
+        {
+            myfirst = offsets[myrank] + p;
+            break;
+        }
+
+        p = line_end(s, n, p) + 1;
+    }
+
+    std::vector<unsigned long long> firsts(nprocs);
+    MPI_Allgather(&myfirst, 1, MPI_UNSIGNED_LONG_LONG, firsts.data(), 1, MPI_UNSIGNED_LONG_LONG, comm);
+
+    /*
+     * Processor i owns [firsts[i]..next first), which is empty if there is no
+     * record start in its piece. Send everyone the part of my piece they own.
+     */
+    std::vector<unsigned long long> ownbegin(nprocs), ownend(nprocs);
+    unsigned long long next = offsets[nprocs];
+
+    for (int i = nprocs-1; i >= 0; --i)
+    {
+        ownbegin[i] = firsts[i] == ULLONG_MAX? next : firsts[i];
+        ownend[i] = next;
+        next = ownbegin[i];
+    }
+
+    auto overlap = [](unsigned long long b1, unsigned long long e1, unsigned long long b2, unsigned long long e2)
+    {
+        return std::max(b1, b2) < std::min(e1, e2)? std::make_pair(std::max(b1, b2), std::min(e1, e2) - std::max(b1, b2)) : std::make_pair(0ULL, 0ULL);
+    };
+
+    std::vector<MPI_Count_t> sendcounts(nprocs), recvcounts(nprocs);
+    std::vector<MPI_Offset_t> sdispls(nprocs), rdispls(nprocs);
+
+    for (int i = 0; i < nprocs; ++i)
+    {
+        auto sendpart = overlap(offsets[myrank], offsets[myrank+1], ownbegin[i], ownend[i]);
+        sendcounts[i] = sendpart.second;
+        sdispls[i] = sendpart.second? sendpart.first - offsets[myrank] : 0;
+        recvcounts[i] = overlap(offsets[i], offsets[i+1], ownbegin[myrank], ownend[myrank]).second;
+    }
+
+    std::exclusive_scan(recvcounts.begin(), recvcounts.end(), rdispls.begin(), static_cast<MPI_Offset_t>(0));
+
+    std::string text(rdispls.back() + recvcounts.back(), '\0');
+    alltoallv_large(stream.data(), sendcounts, sdispls, &text[0], recvcounts, rdispls, MPI_CHAR, comm);
+
+    return text;
+}
+
+DnaBuffer GzipReader::getmydna()
+{
+    /*
+     * BGZF files are split as if they were concatenated in the given order:
+     * every processor takes the blocks starting in its equal share of the total
+     * size, which can span file boundaries. Plain gzip files are inflated whole,
+     * by different processors in turn. Each file's uncompressed stream is then
+     * redistributed by records on its own, and my records of all the files are
+     * indexed in memory. From there on it's the same as reading uncompressed
+     * files: reads are 2-bit encoded into their slots in parallel.
+     */
+    int numfiles = getnumfiles();
+    long long totsize = std::accumulate(filesizes.begin(), filesizes.end(), 0LL);
+    long long mystart = (totsize * myrank) / nprocs;
+    long long myend = (totsize * (myrank+1)) / nprocs;
+    long long fileoffset = 0;
+
+    std::vector<std::string> texts(numfiles); /* whole records of each file that are mine */
+    std::vector<Record> records;
+    unsigned long long totinflated = 0;
+    int numfastq = 0;
+    double elapsed = 0;
+
+    for (int i = 0; i < numfiles; ++i)
+    {
+        long long filestart = std::clamp(mystart - fileoffset, 0LL, filesizes[i]);
+        long long fileend = std::clamp(myend - fileoffset, 0LL, filesizes[i]);
+        fileoffset += filesizes[i];
+
+        elapsed -= MPI_Wtime();
+        std::string stream = bgzf[i]? inflatebgzf(i, filestart, fileend) : inflategzip(i, i % nprocs);
+        elapsed += MPI_Wtime();
+
+        unsigned long long myinflated = stream.size();
+        MPI_Allreduce(MPI_IN_PLACE, &myinflated, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+        totinflated += myinflated;
+
+        bool fastq;
+        texts[i] = gatherrecords(stream, fastq);
+        std::string().swap(stream);
+        numfastq += fastq;
+
+        char const *text = texts[i].data();
+        size_t n = texts[i].size();
+        size_t numrecords = records.size();
+
+        if (fastq)
+        {
+            size_t p = 0;
+
+            while (p < n)
+            {
+                Record record;
+                size_t next;
+
+                if (text[p] == '\n' || text[p] == '\r')
+                {
+                    p = line_end(text, n, p) + 1;
+                    continue;
+                }
+
+                if (!fastq_record_at(text, n, p, true, record, next))
+                {
+                    std::cerr << "Error: malformed FASTQ record in " << std::quoted(get_gz_fname(i)) << std::endl;
+                    MPI_Abort(comm, 1);
+                }
+
+                records.push_back(record);
+                p = next;
+            }
+        }
+        else
+        {
+            auto filerecords = index_fasta(text, n);
+            records.insert(records.end(), filerecords.begin(), filerecords.end());
+        }
+
+        for (size_t j = numrecords; j < records.size(); ++j)
+            records[j].fileid = i;
+    }
+
+    size_t numreads = records.size();
+    std::vector<size_t> readlens(numreads);
+    std::transform(records.cbegin(), records.cend(), readlens.begin(), [](const auto& record) { return record.len; });
+
+    size_t bufsize = DnaBuffer::computebufsize(readlens);
+    DnaBuffer dnabuf(bufsize, numreads, new uint8_t[bufsize], readlens.data());
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        dnabuf.fill(i, texts[records[i].fileid].data() + records[i].pos, records[i].bases);
+    }
+
+    /*
+     * Every processor gets a copy of the read counts and displacements.
+     */
+    MPI_Count_t mycount = numreads;
+    MPI_Allgather(&mycount, 1, MPI_COUNT_TYPE, readcounts.data(), 1, MPI_COUNT_TYPE, comm);
+
+    std::exclusive_scan(readcounts.begin(), readcounts.end(), readdispls.begin(), static_cast<MPI_Offset_t>(0));
+    readdispls.back() = readdispls[nprocs-1] + readcounts.back();
+
+    #if LOG_LEVEL >= 2
+    Logger logger(comm);
+    int numbgzf = std::accumulate(bgzf.begin(), bgzf.end(), 0);
+    logger() << numfiles << " file(s) (" << numbgzf << " BGZF, " << numfastq << " FASTQ), " << totinflated << " bytes inflated at "
+             << std::fixed << std::setprecision(2) << (totinflated / 1048576.0) / elapsed << " MB/second";
+    logger.flush("Gzip input:", 0);
+    size_t mytotbases = std::accumulate(readlens.begin(), readlens.end(), static_cast<size_t>(0));
+    size_t totbases;
+    MPI_Allreduce(&mytotbases, &totbases, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    double percent_proportion = (static_cast<double>(mytotbases) / totbases) * 100.0;
+    logger() << " is responsible for sequences " << Logger::readrangestr(readdispls[myrank], readcounts[myrank]) << " (" << mytotbases << " nucleotides, " << std::fixed << std::setprecision(3) << percent_proportion << "%)";
+    logger.flush("Gzip input:");
+    #endif
+
+    return dnabuf;
+}
@@ -175,17 +175,7 @@ uint32_t SuperFastHash (const char * data, int len) {
 
 void wanghash64(const void *key, void *hashval)
 {
-    uint64_t _key = *((uint64_t const *)key);
-
-    _key = (~_key) + (_key << 21);
-    _key = _key ^ (_key >> 24);
-    _key = (_key + (_key << 3)) + (_key << 8);
-    _key = _key ^ (_key >> 14);
-    _key = (_key + (_key << 2)) + (_key << 4);
-    _key = _key ^ (_key >> 28);
-    _key = _key + (_key << 31);
-
-    *((uint64_t*)hashval) = _key;
+    *((uint64_t*)hashval) = wanghash64(*((uint64_t const *)key));
 }
 
 /* reference: https://naml.us/post/inverse-of-a-hash-function/ */
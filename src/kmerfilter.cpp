@@ -0,0 +1,43 @@
+#include "kmerfilter.hpp"
+
+void KmerFilter::plan(const std::vector<size_t>& taskcnts)
+{
+    if (planned) return;
+    planned = true;
+    keeping = false;
+
+    seen.resize(taskcnts.size());
+    repeats.resize(taskcnts.size());
+    wordmask.resize(taskcnts.size());
+
+    for (size_t task = 0; task < taskcnts.size(); ++task)
+    {
+        /* a power of two words, so that the word is picked by masking */
+        size_t nwords = 1;
+        while (nwords * 64 < taskcnts[task] * BITS_PER_KMER)
+            nwords *= 2;
+
+        seen[task].assign(nwords, 0);
+        repeats[task].assign(nwords, 0);
+        wordmask[task] = nwords - 1;
+    }
+}
+
+void KmerFilter::reset()
+{
+    seen.clear();
+    repeats.clear();
+    wordmask.clear();
+    planned = false;
+    keeping = false;
+}
+
+size_t KmerFilter::bytes() const
+{
+    size_t n = 0;
+
+    for (size_t task = 0; task < seen.size(); ++task)
+        n += (seen[task].size() + repeats[task].size()) * sizeof(uint64_t);
+
+    return n;
+}
@@ -8,6 +8,7 @@
 #include "compiletime.h"
 #include "raduls.h"
 #include <cstring>
+#include <cstdlib>
 #include <numeric>
 #include <algorithm>
 #include <iomanip>
@@ -15,14 +16,50 @@
 #include <omp.h>
 #include <mpi.h>
 #include <thread>
+#include <future>
 #include <deque>
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Log how many supermers were encoded, and how many (K-1)-base overlaps and
+ * lengths sending them saves or costs compared to the default maximum
+ * supermer length.
+ */
+static void log_supermer_cnt(size_t supermer_cnt, size_t default_supermer_cnt, int max_supermer_len, MPI_Comm comm)
+{
+#if LOG_LEVEL >= 2
+    unsigned long long cnts[2] = {supermer_cnt, default_supermer_cnt};
+    MPI_Allreduce(MPI_IN_PLACE, cnts, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+
+    Logger logger(comm);
+    logger() << cnts[0] << " of up to " << max_supermer_len << " nucleotides";
+    if (max_supermer_len != MAX_SUPERMER_LEN) {
+        double bytes_per_supermer = (KMER_SIZE - 1) / 4.0 + sizeof(uint32_t);
+        double saved_mb = (static_cast<double>(cnts[1]) - static_cast<double>(cnts[0])) * bytes_per_supermer / 1048576.0;
+        logger() << " (" << cnts[1] << " with the default " << MAX_SUPERMER_LEN << ", "
+                 << (saved_mb >= 0 ? "saving " : "costing ") << std::fixed << std::setprecision(2) << std::abs(saved_mb) << " MB of communication)";
+    }
+    logger.flush("Supermers:", 0);
+#endif
+}
+
+int get_task_count(int thr_per_worker)
+{
+    int ntasks = omp_get_max_threads() / thr_per_worker * AVG_TASK_PER_WORKER;
+    return ntasks < 1 ? AVG_TASK_PER_WORKER : ntasks;
+}
+
 
 ParallelData
 prepare_supermer(const DnaBuffer& myreads,
      MPI_Comm comm,
      int thr_per_worker,
-     int max_thr_membounded)
+     int max_thr_membounded,
+     int max_supermer_len)
 {
 
     int myrank;
@@ -34,9 +71,8 @@ prepare_supermer(const DnaBuffer& myreads,
 
     /* parallel settings */
     omp_set_nested(1);
-    int ntasks = omp_get_max_threads() / thr_per_worker * AVG_TASK_PER_WORKER;
-    if (ntasks < 1) {
-        ntasks = AVG_TASK_PER_WORKER;
+    int ntasks = get_task_count(thr_per_worker);
+    if (omp_get_max_threads() / thr_per_worker < 1) {
         thr_per_worker = omp_get_max_threads();
     }
     /* for memory bounded operations in this stage, we use another number of threads */
@@ -59,48 +95,40 @@ prepare_supermer(const DnaBuffer& myreads,
     timer.start();
 #endif
 
-    size_t readoffset = numreads;      
+    /* global id of my first read; MPI_Exscan leaves rank 0's value undefined */
+    size_t readoffset = 0;
     MPI_Exscan(&numreads, &readoffset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    if (myrank == 0) readoffset = 0;
       
 
     /* data structure for storing the data of different threads */
-    ParallelData data(nprocs, ntasks, nthr_membounded);
-
-    /* find the destinations of each kmer */
-    FindKmerDestinationsParallel(myreads, nthr_membounded, ntasks*nprocs, data);
-
-#if LOG_LEVEL >= 3
-    timer.stop_and_log("(Inc) K-mer destination finding");
-    timer.start();
-#endif
+    ParallelData data(nprocs, ntasks, nthr_membounded, max_supermer_len);
 
-    /* encode the supermers */
-    #pragma omp parallel num_threads(nthr_membounded)
-    {
-        int tid = omp_get_thread_num();
-        auto& lengths = data.get_my_lengths(tid);
-        auto& supermers = data.get_my_supermers(tid);
-        auto& destinations = data.get_my_destinations(tid);
-        auto& readids = data.get_my_readids(tid);
-
-        SupermerEncoder encoder(lengths, supermers, MAX_SUPERMER_LEN);
-
-        for (size_t i = 0; i < readids.size(); ++i) {
-            encoder.encode(destinations[i], myreads[readids[i]]);
-        }
-
-    }
+    /* find the destination of each kmer and encode the supermers */
+    EncodeSupermersParallel(myreads, 0, numreads, nthr_membounded, ntasks*nprocs, data);
 
 #if LOG_LEVEL >= 3
     timer.stop_and_log("(Inc) Supermer encoding");
 #endif
 
+    log_supermer_cnt(data.supermer_cnt, data.default_supermer_cnt, max_supermer_len, comm);
+
     return data;
 }
 
 
 
-std::pair<std::unique_ptr<KmerSeedBuckets>, std::unique_ptr<KmerListSVec>> exchange_supermer(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatcher, int thr_per_worker)
+/*
+ * One round of supermer exchange for tasks that are already dispatched (and
+ * preprocessed, see ParallelData::preprocess_tasks): my supermers in @data go
+ * to the owners of their tasks, and what I receive is appended to @bucket (or
+ * to @lists for unbalanced tasks). @growth, @spill, @filter and @sketch are
+ * passed on to BucketAssistant; with @filter or @sketch the supermers are
+ * sent twice, the first time only to fill it.
+ */
+static void exchange_supermer_chunk(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatcher,
+     KmerSeedBuckets& bucket, KmerListSVec& lists, int thr_per_worker, double growth, bool logtasks, KmerSpill* spill,
+     KmerFilter* filter = nullptr, KmerSketch* sketch = nullptr)
 {
     int myrank;
     int nprocs;
@@ -114,19 +142,8 @@ timer.start();
 #endif
 
 
-    auto local_tasksz = data.get_local_tasksz();
-    dispatcher.balanced_dispatch(comm, local_tasksz);
-    data.set_task_type(dispatcher.get_task_type());
-    data.preprocess_tasks(thr_per_worker);
-    // dispatcher.plain_dispatch();
     int mytasks = dispatcher.get_taskid(myrank).size();
 
-
-#if LOG_LEVEL >= 3
-timer.stop_and_log("(Inc) Task dispatch");
-timer.start();
-#endif
-
     // deal with local unbalanced tasks
     
     std::vector<int32_t> scounts(nprocs, 0);
@@ -173,10 +190,12 @@ timer.start();
     MPI_Alltoallv(unbalanced_task_length.data(), scounts.data(), sdispls.data(), MPI_UNSIGNED_LONG_LONG, 
             my_unbalanced_task_length.data(), rcounts.data(), rdispls.data(), MPI_UNSIGNED_LONG_LONG, comm);
 
-    for (int i = 0; i < mytasks * nprocs; i++) {
-        logger() <<"i:"<<i<<" "<<my_unbalanced_task_length[i] << "   ";
+    if (logtasks) {
+        for (int i = 0; i < mytasks * nprocs; i++) {
+            logger() <<"i:"<<i<<" "<<my_unbalanced_task_length[i] << "   ";
+        }
+        logger.flush("Unbalanced task length information:");
     }
-    logger.flush("Unbalanced task length information:");
 
     mytasks = dispatcher.get_taskid(myrank).size();
 
@@ -234,12 +253,41 @@ timer.stop_and_log("(Inc) Length exchange");
 timer.start();
 #endif
 
-    KmerSeedBuckets* bucket = new KmerSeedBuckets(mytasks);
-    KmerListSVec* lists = new KmerListSVec(mytasks);
+    /* the largest element is a supermer of the maximum length, or a counted k-mer */
+    size_t max_element_size = std::max(static_cast<size_t>(cnt_bytes(data.max_supermer_len)), sizeof(KmerListEntryS));
+
+    if (filter || sketch) {
+        /* nothing is stored the first time, so nothing is spilled either */
+        KmerSeedBuckets nobucket(mytasks);
+        KmerListSVec nolists(mytasks);
+
+        SupermerExchanger marking_exchanger(comm, MAX_SEND_BATCH, 
+            max_element_size, data.nthr_membounded, data.lengths, 
+            data.supermers, recv_counts, length, nobucket, dispatcher, data.kmerlists,
+            nolists, my_unbalanced_task_length, 1.0, nullptr, filter, sketch); 
+
+        marking_exchanger.initialize();
+        while (marking_exchanger.status != SupermerExchanger::Status::BATCH_DONE)
+        {
+            marking_exchanger.progress();
+        }
+
+        if (filter) {
+            filter->keep();
+        } else {
+            sketch->emit();
+        }
+
+#if LOG_LEVEL >= 3
+timer.stop_and_log(filter ? "(Inc) Supermer exchange for the singleton filter" : "(Inc) Supermer exchange for the sketches");
+timer.start();
+#endif
+    }
+
     SupermerExchanger supermer_exchanger(comm, MAX_SEND_BATCH, 
-        MAX_SUPERMER_LEN, data.nthr_membounded, data.lengths, 
-        data.supermers, recv_counts, length, *bucket, dispatcher, data.kmerlists,
-        *lists, my_unbalanced_task_length); 
+        max_element_size, data.nthr_membounded, data.lengths, 
+        data.supermers, recv_counts, length, bucket, dispatcher, data.kmerlists,
+        lists, my_unbalanced_task_length, growth, spill, filter, sketch); 
 
 
     supermer_exchanger.initialize();
@@ -248,18 +296,423 @@ timer.start();
         supermer_exchanger.progress();
     }
 
+    if (filter) {
+        size_t dropped = supermer_exchanger.compact();
+#if LOG_LEVEL >= 2
+        logger() << dropped << " k-mers seen once dropped (filters took " << filter->bytes() / 1048576 << " MB)";
+        logger.flush("Singleton filter:");
+#endif
+        /* the next exchange has other tasks */
+        filter->reset();
+    }
+
 #if LOG_LEVEL >= 3
 timer.stop_and_log("(Inc) Supermer exchange");
 supermer_exchanger.print_stats();
 #endif
-    
+}
+
+
+std::pair<std::unique_ptr<KmerSeedBuckets>, std::unique_ptr<KmerListSVec>> exchange_supermer(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatcher, int thr_per_worker, KmerSpill* spill, KmerFilter* filter)
+{
+    int myrank;
+    MPI_Comm_rank(comm, &myrank);
+
+#if LOG_LEVEL >= 3
+Timer timer(comm);
+timer.start();
+#endif
+
+    auto local_tasksz = data.get_local_tasksz();
+    dispatcher.balanced_dispatch(comm, local_tasksz);
+    // dispatcher.plain_dispatch();
+    int mytasks = dispatcher.get_taskid(myrank).size();
+
+    data.set_task_type(dispatcher.get_task_type());
+    data.preprocess_tasks(thr_per_worker);
+
+#if LOG_LEVEL >= 3
+timer.stop_and_log("(Inc) Task dispatch");
+#endif
+
+    KmerSeedBuckets* bucket = new KmerSeedBuckets(mytasks);
+    KmerListSVec* lists = new KmerListSVec(mytasks);
+
+    exchange_supermer_chunk(data, comm, dispatcher, *bucket, *lists, thr_per_worker, 1.0, true, spill, filter);
+
+    return std::make_pair(std::unique_ptr<KmerSeedBuckets>(bucket), std::unique_ptr<KmerListSVec>(lists));
+}
+
+
+std::unique_ptr<KmerListS>
+count_kmer_sketch(ParallelData& data, MPI_Comm comm, TaskDispatcher& dispatcher, KmerSketch& sketch, int thr_per_worker)
+{
+    int myrank;
+    MPI_Comm_rank(comm, &myrank);
+
+    auto local_tasksz = data.get_local_tasksz();
+    dispatcher.balanced_dispatch(comm, local_tasksz);
+    int mytasks = dispatcher.get_taskid(myrank).size();
+
+    data.set_task_type(dispatcher.get_task_type());
+    data.preprocess_tasks(thr_per_worker);
+
+    /* the buckets stay empty, the emitted k-mers end up in the lists */
+    KmerSeedBuckets bucket(mytasks);
+    KmerListSVec lists(mytasks);
+
+    exchange_supermer_chunk(data, comm, dispatcher, bucket, lists, thr_per_worker, 1.0, true, nullptr, nullptr, &sketch);
+
+#if LOG_LEVEL >= 2
+    Logger logger(comm);
+    logger() << mytasks << " sketches of " << KmerSketch::DEPTH << " rows, " << sketch.bytes() / 1048576 << " MB";
+    logger.flush("Count-min sketches:");
+#endif
+
+    sketch.reset();
+
+    size_t total = 0;
+    for (const auto& list : lists) {
+        total += list.size();
+    }
+
+    KmerListS* kmerlist = new KmerListS();
+    kmerlist->reserve(total);
+
+    for (auto& list : lists) {
+        kmerlist->insert(kmerlist->end(), list.begin(), list.end());
+        KmerListS().swap(list);
+    }
+
+#if LOG_LEVEL >= 2
+    logger() << total;
+    logger.flush("Valid kmer for process:");
+#endif
+
+    return std::unique_ptr<KmerListS>(kmerlist);
+}
+
+
+std::unique_ptr<KmerListS>
+count_kmer_passes(ParallelData& data,
+     MPI_Comm comm,
+     TaskDispatcher& dispatcher,
+     size_t membudget,
+     int thr_per_worker,
+     KmerSpill* spill,
+     KmerFilter* filter)
+{
+    int myrank;
+    int nprocs;
+    MPI_Comm_rank(comm, &myrank);
+    MPI_Comm_size(comm, &nprocs);
+
+    auto local_tasksz = data.get_local_tasksz();
+    dispatcher.balanced_dispatch(comm, local_tasksz);
+    data.set_task_type(dispatcher.get_task_type());
+    data.preprocess_tasks(thr_per_worker);
+
+    /*
+     * On the receiving side, a k-mer takes its bucket entry, as much again for
+     * the RADULS temporary array, and its share of the counted list (which is
+     * reserved at one entry per LOWER_KMER_FREQ k-mers). Everyone knows the
+     * size of every task, so everyone comes up with the same number of passes:
+     * enough for the most loaded processor. A task can't be split, so there's
+     * no point in more passes than the largest number of tasks per processor.
+     */
+    const auto& tasksz = dispatcher.get_tasksz();
+    double bytes_per_kmer = 2.0 * sizeof(KmerSeedStruct) + static_cast<double>(sizeof(KmerListEntryS)) / LOWER_KMER_FREQ;
+    size_t maxload = 0;
+    size_t maxtasks = 1;
+
+    for (int i = 0; i < nprocs; i++) {
+        size_t load = 0;
+        for (size_t id : dispatcher.get_taskid(i)) {
+            load += tasksz[id];
+        }
+        maxload = std::max(maxload, load);
+        maxtasks = std::max(maxtasks, dispatcher.get_taskid(i).size());
+    }
+
+    size_t npasses = static_cast<size_t>(std::ceil(maxload * bytes_per_kmer / std::max(membudget, static_cast<size_t>(1))));
+    npasses = std::max(static_cast<size_t>(1), std::min(npasses, maxtasks));
+
+#if LOG_LEVEL >= 2
+    Logger logger(comm);
+    logger() << npasses << " (largest load " << maxload << " k-mers, about " << static_cast<size_t>(maxload * bytes_per_kmer / 1048576.0) << " MB, budget " << membudget / 1048576 << " MB)";
+    logger.flush("Counting passes:", 0);
+#endif
+
+    KmerListS* kmerlist = new KmerListS();
+
+    for (size_t pass = 0; pass < npasses; pass++) {
+        TaskDispatcher passdispatcher = dispatcher.get_pass(pass, npasses);
+        int mytasks = passdispatcher.get_taskid(myrank).size();
+
+        auto bucket = std::make_unique<KmerSeedBuckets>(mytasks);
+        auto lists = std::make_unique<KmerListSVec>(mytasks);
+
+        exchange_supermer_chunk(data, comm, passdispatcher, *bucket, *lists, thr_per_worker, 1.0, pass == 0, spill, filter);
+
+        /* the tasks of this pass have been sent by everyone */
+        for (int i = 0; i < nprocs; i++) {
+            for (size_t id : passdispatcher.get_taskid(i)) {
+                data.release_task(id);
+            }
+        }
+
+        auto passlist = filter_kmer(bucket, lists, passdispatcher, thr_per_worker, spill);
+
+        /* buckets go before the counted k-mers are appended */
+        bucket.reset();
+        lists.reset();
+
+        /* the next pass has other tasks, so it makes its own spill plan */
+        if (spill) {
+            spill->reset();
+        }
+
+        kmerlist->insert(kmerlist->end(), passlist->begin(), passlist->end());
+    }
+
+    return std::unique_ptr<KmerListS>(kmerlist);
+}
+
+
+std::pair<std::unique_ptr<KmerSeedBuckets>, std::unique_ptr<KmerListSVec>>
+stream_supermer(const DnaBuffer& myreads,
+     MPI_Comm comm,
+     TaskDispatcher& dispatcher,
+     size_t chunkbases,
+     int thr_per_worker,
+     int max_thr_membounded,
+     KmerSpill* spill,
+     int max_supermer_len)
+{
+    int myrank;
+    int nprocs;
+    MPI_Comm_rank(comm, &myrank);
+    MPI_Comm_size(comm, &nprocs);
+
+    omp_set_nested(1);
+    int ntasks = get_task_count(thr_per_worker);
+    int nthr_membounded = std::min(omp_get_max_threads() , max_thr_membounded);
+
+    /*
+     * Cut my reads into chunks of at least @chunkbases nucleotides (but
+     * whole reads). Every exchange is collective, so everyone goes through
+     * the same number of chunks; processors that run out exchange nothing.
+     */
+    std::vector<size_t> chunkstarts(1, 0);
+    size_t bases = 0;
+
+    for (size_t i = 0; i < myreads.size(); ++i) {
+        bases += myreads[i].size();
+        if (bases >= chunkbases) {
+            chunkstarts.push_back(i + 1);
+            bases = 0;
+        }
+    }
+
+    if (chunkstarts.back() != myreads.size()) {
+        chunkstarts.push_back(myreads.size());
+    }
+
+    unsigned long long nchunks = chunkstarts.size() - 1;
+    MPI_Allreduce(MPI_IN_PLACE, &nchunks, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+    nchunks = std::max(nchunks, 1ULL);
+    chunkstarts.resize(nchunks + 1, myreads.size());
+
+#if LOG_LEVEL >= 2
+    Logger logger(comm);
+    logger() << ntasks << " \t (thread per worker: " << thr_per_worker << ")";
+    logger.flush("Task num:", 0);
+    logger() << chunkstarts.size() - 1 << " chunks of about " << chunkbases << " nucleotides (" << nchunks << " exchanges)";
+    logger.flush("Streaming:", 0);
+#endif
+
+    /*
+     * Two sets of supermer buffers: the next chunk is encoded into one by a
+     * separate thread (which makes no MPI calls) while the other is exchanged.
+     */
+    ParallelData data_x(nprocs, ntasks, nthr_membounded, max_supermer_len);
+    ParallelData data_y(nprocs, ntasks, nthr_membounded, max_supermer_len);
+    ParallelData* cur = &data_x;
+    ParallelData* next = &data_y;
+
+    auto encode_chunk = [&](size_t chunk, ParallelData& data) {
+        EncodeSupermersParallel(myreads, chunkstarts[chunk], chunkstarts[chunk + 1], nthr_membounded, ntasks * nprocs, data);
+    };
+
+    encode_chunk(0, *cur);
+
+    /*
+     * Minimizers are hashed to tasks, so the first chunk is a fair
+     * sample of how big the tasks are going to be.
+     */
+    auto local_tasksz = cur->get_local_tasksz();
+    dispatcher.balanced_dispatch(comm, local_tasksz);
+    int mytasks = dispatcher.get_taskid(myrank).size();
+
+    KmerSeedBuckets* bucket = new KmerSeedBuckets(mytasks);
+    KmerListSVec* lists = new KmerListSVec(mytasks);
+    size_t supermer_cnt = 0, default_supermer_cnt = 0;
+
+    for (size_t chunk = 0; chunk < nchunks; ++chunk) {
+        std::thread encoder;
+
+        if (chunk + 1 < nchunks) {
+            next->clear();
+            encoder = std::thread(encode_chunk, chunk + 1, std::ref(*next));
+        }
+
+        supermer_cnt += cur->supermer_cnt;
+        default_supermer_cnt += cur->default_supermer_cnt;
+
+        cur->set_task_type(dispatcher.get_task_type());
+        cur->preprocess_tasks(thr_per_worker);
+
+        /* reserve buckets for what the chunks so far project to in total */
+        exchange_supermer_chunk(*cur, comm, dispatcher, *bucket, *lists, thr_per_worker, static_cast<double>(nchunks) / (chunk + 1), chunk == 0, spill);
+
+        if (encoder.joinable()) {
+            encoder.join();
+        }
+
+        std::swap(cur, next);
+    }
+
+    log_supermer_cnt(supermer_cnt, default_supermer_cnt, max_supermer_len, comm);
 
     return std::make_pair(std::unique_ptr<KmerSeedBuckets>(bucket), std::unique_ptr<KmerListSVec>(lists));
 }
 
 
+#if KMER_SIZE <= DENSE_KMER_SIZE
+/*
+ * Counting for small K: every received k-mer increments its own counter in an
+ * array of 4^KMER_SIZE, indexed by the k-mer bits, so there is nothing to
+ * sort, and scanning the array yields the k-mers in sorted order. Counters
+ * saturate at the maximum of KmerCounter, which is above UPPER_KMER_FREQ, so
+ * they can be as small as a byte.
+ *
+ * A k-mer always has the same minimizer, hence the same task, so tasks touch
+ * disjoint counters and are counted in parallel without atomics.
+ */
+static std::unique_ptr<KmerListS>
+dense_count_kmer(KmerSeedBuckets& recv_kmerseeds, KmerListSVec& recv_kmerlists, TaskDispatcher& dispatcher, int nthreads, KmerSpill* spill, Logger& logger)
+{
+    constexpr size_t ncounters = 1ULL << (2 * KMER_SIZE);
+    constexpr int shift = 64 - 2 * KMER_SIZE;
+    constexpr KmerCounter maxcnt = std::numeric_limits<KmerCounter>::max();
+
+    int myrank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+
+    auto tasks = dispatcher.get_taskid(myrank);
+    int mytasks = tasks.size();
+
+    KmerCounter* counters = static_cast<KmerCounter*>(std::calloc(ncounters, sizeof(KmerCounter)));
+
+    if (!counters) {
+        std::cerr << "Error: could not allocate " << ncounters * sizeof(KmerCounter) / 1048576 << " MB of k-mer counters on rank " << myrank << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    auto index = [](const TKmer& kmer) {
+        uint64_t word;
+        kmer.CopyDataInto(&word);
+        return word >> shift;
+    };
+
+    auto add = [&](const TKmer& kmer, uint64_t cnt) {
+        KmerCounter& counter = counters[index(kmer)];
+        counter = cnt >= static_cast<uint64_t>(maxcnt - counter) ? maxcnt : counter + cnt;
+    };
+
+    auto add_seeds = [&](const KmerSeedStruct* seeds, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            KmerCounter& counter = counters[index(seeds[j].kmer)];
+            counter += (counter != maxcnt);
+        }
+    };
+
+    #pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+    for (int i = 0; i < mytasks; i++) {
+        if (spill && spill->spilled(i)) {
+            continue;
+        }
+        if (dispatcher.get_task_type()[tasks[i]] == 1) {
+            for (const auto& entry : recv_kmerlists[i]) {
+                add(entry.kmer, entry.cnt);
+            }
+        } else {
+            add_seeds(recv_kmerseeds[i].data(), recv_kmerseeds[i].size());
+        }
+    }
+
+    for (int i = 0; spill && i < mytasks; i++) {
+        if (spill->spilled(i)) {
+            std::vector<KmerSeedStruct> kmerseeds(spill->size(i));
+            spill->read(i, kmerseeds.data());
+            add_seeds(kmerseeds.data(), kmerseeds.size());
+            spill->remove(i);
+        }
+    }
+
+    /* every thread scans a consecutive range of counters, so the lists concatenate in k-mer order */
+    int nranges = nthreads * 4;
+    std::vector<KmerListS> found(nranges);
+
+    #pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+    for (int r = 0; r < nranges; r++) {
+        size_t first = (ncounters * r) / nranges;
+        size_t last = (ncounters * (r + 1)) / nranges;
+        for (size_t idx = first; idx < last; idx++) {
+            /* most counters are zero when K is near DENSE_KMER_SIZE: skip them a word at a time */
+            uint64_t word;
+            if (idx % (8 / sizeof(KmerCounter)) == 0 && idx + 8 / sizeof(KmerCounter) <= last) {
+                std::memcpy(&word, counters + idx, 8);
+                if (!word) {
+                    idx += 8 / sizeof(KmerCounter) - 1;
+                    continue;
+                }
+            }
+            if (counters[idx] >= LOWER_KMER_FREQ && counters[idx] <= UPPER_KMER_FREQ) {
+                uint64_t word = idx << shift;
+                found[r].emplace_back(TKmer(&word), counters[idx]);
+            }
+        }
+    }
+
+    std::free(counters);
+
+    size_t valid_kmer_total = 0;
+    for (const auto& list : found) {
+        valid_kmer_total += list.size();
+    }
+
+    KmerListS* kmerlist = new KmerListS();
+    kmerlist->reserve(valid_kmer_total);
+    for (const auto& list : found) {
+        kmerlist->insert(kmerlist->end(), list.begin(), list.end());
+    }
+
+#if LOG_LEVEL >= 2
+    logger() << ncounters << " counters of " << sizeof(KmerCounter) << " byte(s), " << ncounters * sizeof(KmerCounter) / 1048576 << " MB";
+    logger.flush("Dense k-mer counting:", 0);
+#endif
+
+    logger() << valid_kmer_total;
+    logger.flush("Valid kmer for process:");
+
+    return std::unique_ptr<KmerListS>(kmerlist);
+}
+#endif
+
+
 std::unique_ptr<KmerListS>
-filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<KmerListSVec>& recv_kmerlists, TaskDispatcher& dispatcher, int thr_per_worker)
+filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<KmerListSVec>& recv_kmerlists, TaskDispatcher& dispatcher, int thr_per_worker, KmerSpill* spill)
 {
 
     Logger logger(MPI_COMM_WORLD);
@@ -284,6 +737,23 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
     omp_set_nested(1);
     omp_set_num_threads(nworkers);
 
+#if KMER_SIZE <= DENSE_KMER_SIZE
+    /*
+     * The counter array costs about as much to clear and scan as sorting one
+     * k-mer per 16 bytes of it, so it only pays off with enough k-mers. Everyone
+     * takes the same path, as both log collectively.
+     */
+    unsigned long long myload = 0;
+    for (int i = 0; i < mytasks; i++) {
+        myload += spill && spill->spilled(i) ? spill->size(i) : (*recv_kmerseeds)[i].size() + (*recv_kmerlists)[i].size();
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &myload, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+
+    if (myload * 16 >= (1ULL << (2 * KMER_SIZE)) * sizeof(KmerCounter)) {
+        return dense_count_kmer(*recv_kmerseeds, *recv_kmerlists, dispatcher, thr_per_worker * nworkers, spill, logger);
+    }
+#endif
+
     uint64_t task_seedcnt[mytasks];
     uint64_t task_seedtot = 0;
     uint64_t valid_kmer[mytasks];
@@ -291,8 +761,10 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
 
 
     for (int i = 0; i < mytasks; i++) {
-        task_seedcnt[i] = (*recv_kmerseeds)[i].size();
-        task_seedtot += task_seedcnt[i];
+        bool ondisk = spill && spill->spilled(i);
+        task_seedcnt[i] = ondisk ? spill->size(i) : (*recv_kmerseeds)[i].size();
+        /* only what's in memory at once matters for the choice of sort */
+        task_seedtot += ondisk ? 0 : task_seedcnt[i];
     }
 
     
@@ -333,6 +805,22 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
     int sort = sort_decision(task_seedtot * TKmer::NBYTES, logger);
 
     logger.flush("Sort algorithm decision:");
+
+    /* choose between sorting and hashing to count, estimated on the first tasks that are in memory */
+    double distinct_ratio = 1.0;
+    if (COUNT == 0) {
+        std::vector<int> sampletasks;
+        for (int i = 0; i < mytasks; i++) {
+            if (!(spill && spill->spilled(i)) && dispatcher.get_task_type()[dispatcher.get_taskid(myrank)[i]] == 0) {
+                sampletasks.push_back(i);
+            }
+        }
+        distinct_ratio = estimate_distinct_ratio(*recv_kmerseeds, sampletasks);
+    }
+
+    int count = count_decision(distinct_ratio, sort, logger);
+
+    logger.flush("Counting decision:");
     print_mem_log(nprocs, myrank, "Before Sorting");
     std::cout<<std::endl;
 
@@ -343,7 +831,8 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
     int total_threadnum = thr_per_worker * nworkers;
     bool tasks_processed[mytasks];
     for (int i = 0; i < mytasks; i++) {
-        tasks_processed[i] = false;
+        /* spilled tasks are done on their own afterwards */
+        tasks_processed[i] = spill && spill->spilled(i);
     }
 
     /* sort the receiving vectors */
@@ -385,7 +874,10 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
             }
 
 
-            if (task_type == 0) {
+            if (task_type == 0 && count == 2) {
+                /* counted in a hash table, nothing to sort */
+                start_pos[current_task] = 0;
+            } else if (task_type == 0) {
                 if (sort == 1){
                     start_pos[current_task] = 0;
                     paradis::sort<KmerSeedStruct, TKmer::NBYTES>((*recv_kmerseeds)[current_task].data(), (*recv_kmerseeds)[current_task].data() + task_seedcnt[current_task], thr_per_worker);
@@ -435,7 +927,8 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
     timer.start();
 #endif
 
-    #pragma omp parallel
+    /* hash tables are filled by one thread each, so give every thread tasks */
+    #pragma omp parallel num_threads(count == 2 ? total_threadnum : nworkers)
     {
         int tid = omp_get_thread_num();
         int current_task_idx = tid;
@@ -444,7 +937,9 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
             int current_task = current_task_idx;
             auto task_type = dispatcher.get_task_type()[dispatcher.get_taskid(myrank)[current_task]];
 
-            if (task_type == 0) {
+            if (spill && spill->spilled(current_task)) {
+                /* counted below */
+            } else if (task_type == 0) {
 
 
             /* do a linear scan and filter out the kmers we want */
@@ -477,12 +972,61 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
             }
             */
 
-            count_sorted_task((*recv_kmerseeds)[current_task], kmerlists[current_task], start_pos[current_task], task_seedcnt[current_task], valid_kmer[current_task]);
+            if (count == 2) {
+                count_hashed_task((*recv_kmerseeds)[current_task], kmerlists[current_task], task_seedcnt[current_task], task_seedcnt[current_task] * distinct_ratio, valid_kmer[current_task]);
+            } else {
+                count_sorted_task((*recv_kmerseeds)[current_task], kmerlists[current_task], start_pos[current_task], task_seedcnt[current_task], valid_kmer[current_task]);
+            }
             
             } else if (task_type == 1) {
                 count_sorted_kmerlist((*recv_kmerlists)[current_task], kmerlists[current_task], start_pos[current_task], (*recv_kmerlists)[current_task].size(), valid_kmer[current_task]);
             }
-            current_task_idx += nworkers;
+            current_task_idx += omp_get_num_threads();
+        }
+    }
+
+    /*
+     * Spilled tasks are read back and counted one at a time with all threads.
+     * PARADIS sorts in place, so only the task itself has to fit in memory,
+     * plus the next one which is read ahead meanwhile. They are always sorted,
+     * as a hash table would be filled by one thread only.
+     */
+    std::vector<int> ondisk;
+    size_t ondisk_kmers = 0;
+    for (int i = 0; spill && i < mytasks; i++) {
+        if (spill->spilled(i)) {
+            ondisk.push_back(i);
+            ondisk_kmers += task_seedcnt[i];
+        }
+    }
+
+#if LOG_LEVEL >= 2
+    if (spill) {
+        logger() << ondisk.size() << " of " << mytasks << " tasks (" << ondisk_kmers << " k-mers, " << ondisk_kmers * sizeof(KmerSeedStruct) / 1048576 << " MB)";
+        logger.flush("Spilled tasks:");
+    }
+#endif
+
+    if (!ondisk.empty()) {
+        auto readtask = [spill](int task) {
+            std::vector<KmerSeedStruct> kmerseeds(spill->size(task));
+            spill->read(task, kmerseeds.data());
+            return kmerseeds;
+        };
+
+        auto ahead = std::async(std::launch::async, readtask, ondisk[0]);
+
+        for (size_t k = 0; k < ondisk.size(); k++) {
+            int current_task = ondisk[k];
+            auto kmerseeds = ahead.get();
+
+            if (k + 1 < ondisk.size()) {
+                ahead = std::async(std::launch::async, readtask, ondisk[k + 1]);
+            }
+
+            sort_task(kmerseeds, 1, total_threadnum, start_pos[current_task], task_seedcnt[current_task]);
+            count_sorted_task(kmerseeds, kmerlists[current_task], start_pos[current_task], task_seedcnt[current_task], valid_kmer[current_task]);
+            spill->remove(current_task);
         }
     }
 
@@ -536,38 +1080,41 @@ filter_kmer(std::unique_ptr<KmerSeedBuckets>& recv_kmerseeds, std::unique_ptr<Km
 }
 
 
-void FindKmerDestinationsParallel(const DnaBuffer& myreads, int nthreads, int tot_tasks, ParallelData& data) {
-    
+void EncodeSupermersParallel(const DnaBuffer& myreads, size_t first, size_t last, int nthreads, int tot_tasks, ParallelData& data) {
+
     assert(nthreads > 0);
 
-    #pragma omp parallel for num_threads(nthreads) schedule(static)
-    for (size_t i = 0; i < myreads.size(); ++i)
+    #pragma omp parallel num_threads(nthreads)
     {
         int tid = omp_get_thread_num();
+        SupermerEncoder encoder(data.get_my_lengths(tid), data.get_my_supermers(tid), data.max_supermer_len);
 
-        auto &dest = data.register_new_destination(tid, i);
-        if (myreads[i].size() < KMER_SIZE)
-            continue;
-        dest.reserve(myreads[i].size() - KMER_SIZE + 1);
-
-        std::vector<TMmer> repmers = TMmer::GetRepMmers(myreads[i]);
-
-        Minimizer_Deque deque;
-        int head_pos = 0;
+        #pragma omp for schedule(static)
+        for (size_t i = first; i < last; ++i)
+        {
+            if (myreads[i].size() < KMER_SIZE)
+                continue;
+
+            Minimizer_Ring window;
+            encoder.start(myreads[i]);
+
+            /* m-mer @head_pos enters the window of the k-mer ending with it, m-mer @head_pos - WINDOW leaves */
+            TMmer::ForEachRepMmer(myreads[i], [&](int head_pos, const TMmer& repmer) {
+                window.remove_minimizer(head_pos - Minimizer_Ring::WINDOW);
+                window.insert_minimizer(repmer.GetHash(), head_pos);
+                if (head_pos >= Minimizer_Ring::WINDOW - 1) {
+                    encoder.add(GetMinimizerOwner(window.get_current_minimizer(), tot_tasks));
+                }
+            });
 
-        /* initialize the deque */
-        for(; head_pos < KMER_SIZE - MINIMIZER_SIZE; head_pos++) {
-            deque.insert_minimizer(repmers[head_pos].GetHash(), head_pos);
+            encoder.finish();
         }
-        int tail_pos = head_pos - KMER_SIZE + MINIMIZER_SIZE - 1;
 
-        /* start the main loop */
-        for(; head_pos < repmers.size(); head_pos++, tail_pos++) {
-            deque.insert_minimizer(repmers[head_pos].GetHash(), head_pos);
-            deque.remove_minimizer(tail_pos);
-            dest.push_back(GetMinimizerOwner(deque.get_current_minimizer(), tot_tasks));
+        #pragma omp critical
+        {
+            data.supermer_cnt += encoder.supermer_cnt;
+            data.default_supermer_cnt += encoder.default_supermer_cnt;
         }
-
     }
 }
 
@@ -719,6 +1266,9 @@ void sort_task(std::vector<T>& kmerseeds, int sort, int thr_per_worker, size_t&
 
 }
 
+/* also for bench/count_bench, the calls above are all inlined */
+template void sort_task<KmerSeedStruct>(std::vector<KmerSeedStruct>& kmerseeds, int sort, int thr_per_worker, size_t& start_pos, size_t seedcnt);
+
 
 void count_sorted_task(std::vector<KmerSeedStruct>& kmerseeds, KmerListS& kmerlist, size_t start_pos, size_t seedcnt, size_t& valid_kmer, bool filter) {
     kmerlist.clear();
@@ -775,4 +1325,177 @@ void count_sorted_kmerlist(KmerListS& kmers, KmerListS& kmerlist, size_t start_p
         cur_kmer_cnt = kmers[idx].cnt;
         last_mer = cur_mer;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Open addressing table for the k-mers of one task. Slots come in groups of
+ * HashCounter::GROUP, each with a one-byte tag per slot: 0 if the slot is
+ * empty, otherwise the top bit and 7 bits of the hash. A lookup compares the
+ * tags of a whole group at once and only looks at the k-mers whose tag
+ * matches, then moves on to the next group (linear probing) while the group
+ * is full.
+ */
+class HashCounter {
+public:
+    static constexpr size_t GROUP = 16;
+
+    HashCounter(size_t expected) : used(0) {
+        size_t ngroups = 1;
+        while (ngroups * GROUP * 7 < expected * 8) ngroups *= 2;
+        allocate(ngroups);
+    }
+
+    void insert(const TKmer& kmer, uint32_t cnt) {
+        uint64_t h = hash_kmer(kmer);
+        uint8_t tag = 0x80 | (h & 0x7f);
+
+        for (size_t g = (h >> 7) & groupmask; ; g = (g + 1) & groupmask) {
+            uint8_t* grouptags = tags.data() + g * GROUP;
+            uint32_t matches, empty;
+            group_masks(grouptags, tag, matches, empty);
+
+            while (matches) {
+                size_t slot = g * GROUP + __builtin_ctz(matches);
+                if (kmers[slot] == kmer) {
+                    /* only counts up to UPPER_KMER_FREQ matter */
+                    counts[slot] = std::min<uint64_t>(counts[slot] + cnt, UPPER_KMER_FREQ + 1);
+                    return;
+                }
+                matches &= matches - 1;
+            }
+
+            if (empty) {
+                size_t slot = g * GROUP + __builtin_ctz(empty);
+                grouptags[slot - g * GROUP] = tag;
+                kmers[slot] = kmer;
+                counts[slot] = std::min<uint64_t>(cnt, UPPER_KMER_FREQ + 1);
+                if (++used * 8 > tags.size() * 7) grow();
+                return;
+            }
+        }
+    }
+
+    /* number of distinct k-mers */
+    size_t size() const { return used; }
+
+    /* appends the k-mers within the frequency bounds to @kmerlist, in no particular order */
+    size_t collect(KmerListS& kmerlist) const {
+        size_t valid = 0;
+        for (size_t slot = 0; slot < tags.size(); slot++) {
+            if (tags[slot] && counts[slot] >= LOWER_KMER_FREQ && counts[slot] <= UPPER_KMER_FREQ) {
+                kmerlist.emplace_back(kmers[slot], counts[slot]);
+                valid++;
+            }
+        }
+        return valid;
+    }
+
+private:
+    std::vector<uint8_t> tags;
+    std::vector<TKmer> kmers;
+    std::vector<uint32_t> counts;
+    size_t groupmask;
+    size_t used;
+
+    void allocate(size_t ngroups) {
+        groupmask = ngroups - 1;
+        tags.assign(ngroups * GROUP, 0);
+        kmers.resize(ngroups * GROUP);
+        counts.resize(ngroups * GROUP);
+    }
+
+    static void group_masks(const uint8_t* grouptags, uint8_t tag, uint32_t& matches, uint32_t& empty) {
+#ifdef __SSE2__
+        __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(grouptags));
+        matches = _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_set1_epi8(static_cast<char>(tag))));
+        empty = _mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_setzero_si128()));
+#else
+        matches = empty = 0;
+        for (size_t i = 0; i < GROUP; i++) {
+            matches |= static_cast<uint32_t>(grouptags[i] == tag) << i;
+            empty |= static_cast<uint32_t>(grouptags[i] == 0) << i;
+        }
+#endif
+    }
+
+    void grow() {
+        std::vector<uint8_t> oldtags;
+        std::vector<TKmer> oldkmers;
+        std::vector<uint32_t> oldcounts;
+        oldtags.swap(tags);
+        oldkmers.swap(kmers);
+        oldcounts.swap(counts);
+
+        allocate((groupmask + 1) * 2);
+        used = 0;
+        for (size_t slot = 0; slot < oldtags.size(); slot++) {
+            if (oldtags[slot]) insert(oldkmers[slot], oldcounts[slot]);
+        }
+    }
+};
+
+void count_hashed_task(const std::vector<KmerSeedStruct>& kmerseeds, KmerListS& kmerlist, size_t seedcnt, size_t expected, size_t& valid_kmer) {
+    HashCounter counter(std::min(std::max<size_t>(expected, 1), seedcnt));
+    for (size_t idx = 0; idx < seedcnt; idx++) {
+        counter.insert(kmerseeds[idx].kmer, 1);
+    }
+
+    kmerlist.clear();
+    kmerlist.reserve(seedcnt / LOWER_KMER_FREQ);
+    valid_kmer = counter.collect(kmerlist);
+}
+
+double estimate_distinct_ratio(const KmerSeedBuckets& kmerseeds, const std::vector<int>& tasks) {
+    /*
+     * Only k-mers with 4 hash bits set to 0 are looked at, so every
+     * occurrence of 1/16 of the distinct k-mers is, and their ratio is that
+     * of all k-mers. Whole tasks are sampled until about 2^20 k-mers are seen.
+     */
+    constexpr size_t enough = 1 << 20;
+    HashCounter sample(enough / 16);
+    size_t seen = 0, sampled = 0;
+
+    for (size_t k = 0; k < tasks.size() && seen < enough; k++) {
+        for (const auto& seed : kmerseeds[tasks[k]]) {
+            if ((hash_kmer(seed.kmer) >> 60) == 0) {
+                sample.insert(seed.kmer, 1);
+                sampled++;
+            }
+        }
+        seen += kmerseeds[tasks[k]].size();
+    }
+
+    return sampled ? static_cast<double>(sample.size()) / sampled : -1.0;
+}
+
+int count_decision(double distinct_ratio, int sort, Logger& logger) {
+    int count = 0;
+    if( COUNT == 1 ) {
+        count = 1;
+        logger() << "Counting sorted k-mers.";
+    } else if( COUNT == 2 ) {
+        count = 2;
+        logger() << "Counting k-mers in hash tables.";
+    } else {
+        /*
+         * COUNT == 0, decide upon the estimated ratio. Hashing is one pass
+         * but a random access per k-mer, so it wins while the tables stay
+         * small; RADULS is harder to beat than PARADIS.
+         */
+        double max_ratio = (sort == 2) ? 0.1 : 0.25;
+        if (distinct_ratio < 0) {
+            count = 1;
+            logger() << "No k-mers in memory to sample. Counting sorted k-mers.";
+        } else {
+            logger() << "About " << std::fixed << std::setprecision(3) << distinct_ratio << " distinct k-mers per k-mer. ";
+            if (distinct_ratio <= max_ratio) {
+                count = 2;
+                logger() << "Counting k-mers in hash tables.";
+            } else {
+                count = 1;
+                logger() << "Counting sorted k-mers.";
+            }
+        }
+    }
+    return count;
+}
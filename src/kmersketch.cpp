@@ -0,0 +1,47 @@
+#include "kmersketch.hpp"
+#include <numeric>
+#include <algorithm>
+
+void KmerSketch::plan(const std::vector<size_t>& taskcnts)
+{
+    if (planned) return;
+    planned = true;
+    emitting = false;
+
+    counters.resize(taskcnts.size());
+    widths.resize(taskcnts.size());
+    emitted.resize(taskcnts.size());
+
+    size_t total = std::accumulate(taskcnts.begin(), taskcnts.end(), static_cast<size_t>(0));
+
+    for (size_t task = 0; task < taskcnts.size(); ++task)
+    {
+        double share = total? static_cast<double>(taskcnts[task]) / total : 1.0 / taskcnts.size();
+        size_t taskbytes = static_cast<size_t>(budget * share);
+
+        widths[task] = std::max(static_cast<size_t>(1), (taskbytes / 4 * 3) / (DEPTH * sizeof(KmerCounter)));
+        counters[task].assign(DEPTH * widths[task], 0);
+
+        /* at most 2^32 words, see first_emission */
+        emitted[task].assign(std::min(std::max(static_cast<size_t>(1), (taskbytes / 4) / sizeof(uint64_t)), static_cast<size_t>(1) << 32), 0);
+    }
+}
+
+void KmerSketch::reset()
+{
+    counters.clear();
+    widths.clear();
+    emitted.clear();
+    planned = false;
+    emitting = false;
+}
+
+size_t KmerSketch::bytes() const
+{
+    size_t n = 0;
+
+    for (size_t task = 0; task < counters.size(); ++task)
+        n += counters[task].size() * sizeof(KmerCounter) + emitted[task].size() * sizeof(uint64_t);
+
+    return n;
+}
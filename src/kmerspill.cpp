@@ -0,0 +1,144 @@
+#include "kmerspill.hpp"
+#include "memcheck.hpp"
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+KmerSpill::KmerSpill(const std::string& scratchdir, size_t budget, size_t elemsize, MPI_Comm comm) :
+    scratchdir(scratchdir), budget(budget), elemsize(elemsize), planned(false), numspilled(0)
+{
+    MPI_Comm_rank(comm, &myrank);
+
+    if (budget == 0)
+    {
+        /*
+         * Processes on the same node share its free memory.
+         */
+        MPI_Comm nodecomm;
+        int ppn;
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, myrank, MPI_INFO_NULL, &nodecomm);
+        MPI_Comm_size(nodecomm, &ppn);
+        MPI_Comm_free(&nodecomm);
+
+        size_t memfree_kb;
+        if (get_free_memory_kb(&memfree_kb) != 1)
+            this->budget = (memfree_kb * 921) / ppn; /* 1024 * 0.9 = 921 */
+    }
+}
+
+std::string KmerSpill::filename(size_t task) const
+{
+    std::ostringstream ss;
+    ss << scratchdir << "/ukmerc." << getpid() << "." << myrank << "." << task << ".kmers";
+    return ss.str();
+}
+
+void KmerSpill::plan(const std::vector<size_t>& taskcnts)
+{
+    if (planned) return;
+    planned = true;
+
+    files.assign(taskcnts.size(), -1);
+    sizes.assign(taskcnts.size(), 0);
+
+    /*
+     * No budget (free memory unknown) means nothing is spilled.
+     */
+    if (budget == 0) return;
+
+    std::vector<size_t> order(taskcnts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return taskcnts[a] > taskcnts[b]; });
+
+    size_t inmemory = std::accumulate(taskcnts.begin(), taskcnts.end(), static_cast<size_t>(0)) * 2 * elemsize;
+
+    for (size_t task : order)
+    {
+        if (inmemory <= budget || taskcnts[task] == 0)
+            break;
+
+        std::string fname = filename(task);
+        files[task] = open(fname.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+
+        if (files[task] == -1)
+        {
+            std::cerr << "Error: could not create " << std::quoted(fname) << ": " << std::strerror(errno) << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        inmemory -= taskcnts[task] * 2 * elemsize;
+        numspilled++;
+    }
+}
+
+void KmerSpill::write(size_t task, size_t pos, const void *elems, size_t n) const
+{
+    char const *buf = static_cast<char const*>(elems);
+    size_t nbytes = n * elemsize;
+    off_t offset = pos * elemsize;
+
+    while (nbytes > 0)
+    {
+        ssize_t written = pwrite(files[task], buf, nbytes, offset);
+
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: could not write to " << std::quoted(filename(task)) << ": " << std::strerror(errno) << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        buf += written;
+        nbytes -= written;
+        offset += written;
+    }
+}
+
+void KmerSpill::read(size_t task, void *elems) const
+{
+    char *buf = static_cast<char*>(elems);
+    size_t nbytes = sizes[task] * elemsize;
+    off_t offset = 0;
+
+    while (nbytes > 0)
+    {
+        ssize_t got = pread(files[task], buf, nbytes, offset);
+
+        if (got <= 0)
+        {
+            if (got < 0 && errno == EINTR) continue;
+            std::cerr << "Error: could not read back " << std::quoted(filename(task)) << ": " << (got < 0? std::strerror(errno) : "file too short") << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+
+        buf += got;
+        nbytes -= got;
+        offset += got;
+    }
+}
+
+void KmerSpill::remove(size_t task)
+{
+    if (!spilled(task)) return;
+
+    close(files[task]);
+    unlink(filename(task).c_str());
+    files[task] = -1;
+    numspilled--;
+}
+
+void KmerSpill::reset()
+{
+    for (size_t task = 0; task < files.size(); ++task)
+        remove(task);
+
+    files.clear();
+    sizes.clear();
+    planned = false;
+}
@@ -5,32 +5,56 @@
 #include "logger.hpp"
 #include "timer.hpp"
 #include "fastaindex.hpp"
+#include "fastqreader.hpp"
+#include "gzipreader.hpp"
+#include "readcache.hpp"
 #include "dnabuffer.hpp"
 #include "dnaseq.hpp"
 #include "kmerops.hpp"
 #include "compiletime.h"
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
 
-std::string fasta_fname;
+/*
+ * Runtime parameters (see usage()).
+ */
+std::vector<std::string> input_fnames;
+FastaIndex::InputMode input_mode = FastaIndex::MPIIO;
+bool write_faidx = false;
+std::string cache_fname;
+size_t stream_mbases = 0; /* 0: no streaming */
+double membudget_gb = 0; /* 0: count all tasks in one pass */
+std::string scratch_dir; /* empty: no spilling */
+bool drop_singletons = false; /* -B */
+double sketch_mb = 0; /* 0: exact counting */
+int max_supermer_len = MAX_SUPERMER_LEN;
+
+int myrank;
+int nprocs;
+
+void usage(char const *prg);
+int parse_cmd_line(int argc, char *argv[]);
+DnaBuffer read_fasta(Timer& timer, std::vector<size_t>& overlaps);
+DnaBuffer read_fastq(Timer& timer);
+DnaBuffer read_gzip(Timer& timer);
+DnaBuffer read_cache(Timer& timer);
+void write_cache(const DnaBuffer& mydna, const std::vector<size_t>& overlaps, Timer& timer);
 
 int main(int argc, char **argv){
     MPI_Init(&argc, &argv);
 
     Logger log(MPI_COMM_WORLD);
     Timer timer(MPI_COMM_WORLD);
-    std::ostringstream ss;
-
-    if (argc < 2){
-        std::cerr << "Usage: " << argv[0] << " <fasta file>" << std::endl;
-        exit(1);
-    }
 
-    fasta_fname = argv[1];
-
-    int myrank;
-    int nprocs;
     MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
     MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
 
+    if (parse_cmd_line(argc, argv) != 0){
+        MPI_Finalize();
+        return 1;
+    }
+
     if (myrank == 0){
         log() << "Compiling Parameters:" << std::endl;
         log() << "      KMER_SIZE: " << KMER_SIZE << std::endl;
@@ -43,46 +67,375 @@ int main(int argc, char **argv){
         log() << "      DEBUG: " << DEBUG << std::endl;
         log() << "      MAX_SEND_BATCH: " << MAX_SEND_BATCH << std::endl;
         log() << "      AVG_TASK_PER_WORKER: " << AVG_TASK_PER_WORKER << std::endl;
-        log() << "      SORT (0: runtime decision, 1: PARADIS, 2: RADULS): " << SORT << std::endl << std::endl;
+        log() << "      DENSE_KMER_SIZE (dense counting up to this K): " << DENSE_KMER_SIZE << std::endl;
+        log() << "      SORT (0: runtime decision, 1: PARADIS, 2: RADULS): " << SORT << std::endl;
+        log() << "      COUNT (0: runtime decision, 1: sort, 2: hash tables): " << COUNT << std::endl << std::endl;
 
         log() << "Runtime Parameters:" << std::endl;
-        log() << "      Fasta File: " << std::quoted(fasta_fname)<< std::endl;
+        log() << "      Input Files:";
+        for (const auto& fname : input_fnames) log() << " " << std::quoted(fname);
+        log() << std::endl;
+        if (!cache_fname.empty()) log() << "      Read Cache: " << std::quoted(cache_fname) << std::endl;
+        log() << "      Input Mode: " << (input_mode == FastaIndex::MMAP? "mmap" : "mpiio") << std::endl;
+        if (stream_mbases) log() << "      Streaming Chunk Size: " << stream_mbases << " Mbp" << std::endl;
+        if (membudget_gb) log() << "      Counting Memory Budget: " << membudget_gb << " GB" << std::endl;
+        if (!scratch_dir.empty()) log() << "      Spill Directory: " << std::quoted(scratch_dir) << std::endl;
+        if (drop_singletons) log() << "      Singleton Filter: " << KmerFilter::BITS_PER_KMER << " bits per k-mer" << std::endl;
+        if (sketch_mb) log() << "      Approximate Counting: " << sketch_mb << " MB of count-min sketches per process" << std::endl;
+        log() << "      Maximum Supermer Length: " << max_supermer_len << std::endl;
         log() << "      Nprocs:" << nprocs << std::endl;
         log() << "      Default Maximum Thread Count Per Process: " << omp_get_max_threads() << std::endl;
     }
     log.flush(log(), 0);
 
+    /*
+     * An existing read cache replaces the input files altogether.
+     */
+    bool fromcache = !cache_fname.empty() && ReadCache::iscache(cache_fname, MPI_COMM_WORLD);
+
+    if (!fromcache && input_fnames.empty())
+    {
+        if (!myrank) std::cerr << "Error: no input files given and " << std::quoted(cache_fname) << " is not a read cache" << std::endl;
+        MPI_Finalize();
+        return 1;
+    }
+
+    /*
+     * All input files have to be of the same kind: gzip compressed (FASTA or
+     * FASTQ, which may differ between files), FASTQ, or FASTA.
+     */
+    enum { FASTA, FASTQ, GZIP } format = FASTA;
+
+    for (size_t i = 0; !fromcache && i < input_fnames.size(); ++i)
+    {
+        auto f = GzipReader::isgzip(input_fnames[i], MPI_COMM_WORLD)? GZIP : FastqReader::isfastq(input_fnames[i], MPI_COMM_WORLD)? FASTQ : FASTA;
+
+        if (i > 0 && f != format)
+        {
+            if (!myrank) std::cerr << "Error: " << std::quoted(input_fnames[i]) << " is not of the same format as " << std::quoted(input_fnames[0]) << std::endl;
+            MPI_Finalize();
+            return 1;
+        }
+
+        format = f;
+    }
+
+    std::vector<size_t> overlaps; /* of split FASTA records, see FastaIndex::getpartition */
+    DnaBuffer mydna = fromcache? read_cache(timer) : format == GZIP? read_gzip(timer) : format == FASTQ? read_fastq(timer) : read_fasta(timer, overlaps);
+
+    if (!fromcache && !cache_fname.empty())
+        write_cache(mydna, overlaps, timer);
+
+
+    /* start kmer counting */
+    auto dispatcher = TaskDispatcher(nprocs, get_task_count());
+    std::unique_ptr<KmerSeedBuckets> bucket;
+    std::unique_ptr<KmerListSVec> lists;
+    std::unique_ptr<KmerListS> kmerlist;
+    std::unique_ptr<KmerSpill> spill;
+    std::unique_ptr<KmerFilter> filter;
+
+    if (!scratch_dir.empty())
+        spill.reset(new KmerSpill(scratch_dir, static_cast<size_t>(membudget_gb * 1073741824.0), sizeof(KmerSeedStruct), MPI_COMM_WORLD));
+
+    if (drop_singletons)
+        filter.reset(new KmerFilter());
+
+    if (sketch_mb)
+    {
+        timer.start();
+        auto data = prepare_supermer(mydna, MPI_COMM_WORLD, THREAD_PER_WORKER, MAX_THREAD_MEMORY_BOUNDED, max_supermer_len);
+        timer.stop_and_log("prepare_supermer");
+
+        timer.start();
+        KmerSketch sketch(static_cast<size_t>(sketch_mb * 1048576.0));
+        kmerlist = count_kmer_sketch(data, MPI_COMM_WORLD, dispatcher, sketch, THREAD_PER_WORKER);
+        timer.stop_and_log("count_kmer_sketch");
+    }
+    else if (membudget_gb)
+    {
+        timer.start();
+        auto data = prepare_supermer(mydna, MPI_COMM_WORLD, THREAD_PER_WORKER, MAX_THREAD_MEMORY_BOUNDED, max_supermer_len);
+        timer.stop_and_log("prepare_supermer");
+
+        timer.start();
+        kmerlist = count_kmer_passes(data, MPI_COMM_WORLD, dispatcher, static_cast<size_t>(membudget_gb * 1073741824.0), THREAD_PER_WORKER, spill.get(), filter.get());
+        timer.stop_and_log("count_kmer_passes");
+    }
+    else if (stream_mbases)
+    {
+        timer.start();
+        std::tie(bucket, lists) = stream_supermer(mydna, MPI_COMM_WORLD, dispatcher, stream_mbases * 1000000, THREAD_PER_WORKER, MAX_THREAD_MEMORY_BOUNDED, spill.get(), max_supermer_len);
+        timer.stop_and_log("stream_supermer");
+    }
+    else
+    {
+        timer.start();
+        auto data = prepare_supermer(mydna, MPI_COMM_WORLD, THREAD_PER_WORKER, MAX_THREAD_MEMORY_BOUNDED, max_supermer_len);
+        timer.stop_and_log("prepare_supermer");
+
+        timer.start();
+        std::tie(bucket, lists) = exchange_supermer(data, MPI_COMM_WORLD, dispatcher, THREAD_PER_WORKER, spill.get(), filter.get());
+        timer.stop_and_log("exchange_supermer");
+    }
+
+    if (!kmerlist)
+    {
+        timer.start();
+        kmerlist = filter_kmer(bucket, lists, dispatcher, THREAD_PER_WORKER, spill.get());
+        timer.stop_and_log("filter_kmer");
+    }
+
+    print_kmer_histogram(*kmerlist, MPI_COMM_WORLD);
+
+    MPI_Finalize();
+    return 0;
+}
+
+DnaBuffer read_fasta(Timer& timer, std::vector<size_t>& overlaps)
+{
+    std::ostringstream ss;
+
     timer.start();
-    FastaIndex index(fasta_fname, MPI_COMM_WORLD);
-    ss << "reading " << std::quoted(index.get_faidx_fname()) << " and scattering to all MPI tasks";
+    FastaIndex index(input_fnames, MPI_COMM_WORLD, write_faidx);
+    if (index.getnumfiles() > 1) ss << "reading or building " << index.getnumfiles() << " .fai files and distributing to all MPI tasks";
+    else ss << "reading or building " << std::quoted(index.get_faidx_fname()) << " and distributing to all MPI tasks";
     timer.stop_and_log(ss.str().c_str());
-
     ss.clear(); ss.str("");
 
+    timer.start();
+    DnaBuffer mydna = index.getmydna(input_mode);
+    if (index.getnumfiles() > 1) ss << "reading and 2-bit encoding sequences of " << index.getnumfiles() << " FASTA files in parallel";
+    else ss << "reading and 2-bit encoding " << std::quoted(index.get_fasta_fname()) << " sequences in parallel";
+    timer.stop_and_log(ss.str().c_str());
+
+    overlaps = index.getmyoverlaps();
+    return mydna;
+}
+
+DnaBuffer read_fastq(Timer& timer)
+{
+    /*
+     * No index needed, and always MPI-IO (-I doesn't apply).
+     */
+    std::ostringstream ss;
 
     timer.start();
-    DnaBuffer mydna = index.getmydna();
-    ss << "reading and 2-bit encoding " << std::quoted(index.get_fasta_fname()) << " sequences in parallel";
+    FastqReader reader(input_fnames, MPI_COMM_WORLD);
+    DnaBuffer mydna = reader.getmydna();
+    if (reader.getnumfiles() > 1) ss << "reading and 2-bit encoding sequences of " << reader.getnumfiles() << " FASTQ files in parallel";
+    else ss << "reading and 2-bit encoding " << std::quoted(reader.get_fastq_fname()) << " sequences in parallel";
     timer.stop_and_log(ss.str().c_str());
-    ss.clear(); ss.str("");
 
+    return mydna;
+}
+
+DnaBuffer read_gzip(Timer& timer)
+{
+    /*
+     * FASTA or FASTQ, BGZF or plain gzip. Also no index.
+     */
+    std::ostringstream ss;
 
-    /* start kmer counting */
     timer.start();
-    auto data = prepare_supermer(mydna, MPI_COMM_WORLD);
-    timer.stop_and_log("prepare_supermer");
+    GzipReader reader(input_fnames, MPI_COMM_WORLD);
+    DnaBuffer mydna = reader.getmydna();
+    if (reader.getnumfiles() > 1) ss << "inflating, reading and 2-bit encoding sequences of " << reader.getnumfiles() << " gzip files in parallel";
+    else ss << "inflating, reading and 2-bit encoding " << std::quoted(reader.get_gz_fname()) << " sequences in parallel";
+    timer.stop_and_log(ss.str().c_str());
+
+    return mydna;
+}
+
+DnaBuffer read_cache(Timer& timer)
+{
+    /*
+     * Already 2-bit encoded, nothing to parse.
+     */
+    std::ostringstream ss;
 
     timer.start();
-    auto dispatcher = TaskDispatcher(nprocs, data.ntasks);
-    auto [bucket, lists] = exchange_supermer(data, MPI_COMM_WORLD, dispatcher);
-    timer.stop_and_log("exchange_supermer");
+    ReadCache cache(cache_fname, MPI_COMM_WORLD);
+    DnaBuffer mydna = cache.getmydna();
+    ss << "reading 2-bit encoded sequences from " << std::quoted(cache.get_cache_fname()) << " in parallel";
+    timer.stop_and_log(ss.str().c_str());
+
+    return mydna;
+}
+
+void write_cache(const DnaBuffer& mydna, const std::vector<size_t>& overlaps, Timer& timer)
+{
+    std::ostringstream ss;
 
     timer.start();
-    auto kmerlist = filter_kmer(bucket, lists, dispatcher);
-    timer.stop_and_log("filter_kmer");
+    ReadCache cache(cache_fname, MPI_COMM_WORLD);
+    cache.write(mydna, overlaps);
+    ss << "writing 2-bit encoded sequences to " << std::quoted(cache.get_cache_fname());
+    timer.stop_and_log(ss.str().c_str());
+}
 
-    print_kmer_histogram(*kmerlist, MPI_COMM_WORLD);
+void usage(char const *prg)
+{
+    std::cerr << "Usage: " << prg << " [options] <input file> [<input file> ...]\n"
+              << "       " << prg << " [options] -C FILE\n"
+              << "Input files are FASTA or FASTQ, optionally gzip/bgzip compressed, all of the same kind.\n"
+              << "Several files are counted together, as if they were concatenated.\n"
+              << "Options:\n"
+              << "    -L FILE  read input file names from FILE (one per line), in addition to any given as arguments\n"
+              << "    -I STR   FASTA input mode: 'mpiio' reads with collective MPI-IO (default, for parallel filesystems),\n"
+              << "             'mmap' maps the FASTA into memory (for node-local or page-cached files)\n"
+              << "    -C FILE  2-bit read cache: if FILE is a read cache, count its reads instead of parsing the input files\n"
+              << "             (which may then be left out), otherwise parse the input files and write their reads to FILE.\n"
+              << "             The cache is not checked against the input files, remove it when they change\n"
+              << "    -S NUM   stream: encode and exchange supermers in chunks of NUM million nucleotides per process,\n"
+              << "             holding only one chunk's supermers at a time (default: all at once). This bounds the\n"
+              << "             supermer buffers only: all reads are still loaded before the first chunk\n"
+              << "    -M GB    counting memory budget per process: received k-mers are exchanged, sorted and counted\n"
+              << "             in as many passes over groups of tasks as needed to stay within GB (not with -S)\n"
+              << "    -T DIR   spill the largest tasks' received k-mers to files in DIR (node-local scratch) when they\n"
+              << "             don't fit in memory: within the -M budget, or else the node's free memory\n"
+              << "    -B       drop k-mers seen only once before they are sorted, with Bloom filters filled by exchanging\n"
+              << "             the supermers twice (not with -S). Counts stay exact. Buckets are still sized for all\n"
+              << "             received k-mers and the filters are held during the exchange, so peak memory goes up;\n"
+              << "             the memory for sorting goes down\n"
+              << "    -A MB    approximate counting in MB of count-min sketches per process, whatever the input size:\n"
+              << "             counts are estimates, never below the true count, and a few k-mers may be missing.\n"
+              << "             Supermers are exchanged twice (not with -S, -M, -T or -B)\n"
+              << "    -X LEN   maximum supermer length in nucleotides (default: " << MAX_SUPERMER_LEN << ", at least " << KMER_SIZE << "): longer\n"
+              << "             supermers repeat fewer (K-1)-base overlaps, e.g. for long accurate reads, at the cost of larger\n"
+              << "             exchange batches\n"
+              << "    -W       write the FASTA index to {fasta}.fai when it has to be built (no .fai found)\n"
+              << "    -h       print this message\n" << std::endl;
+}
+
+int parse_cmd_line(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "A:BC:I:L:M:S:T:X:Wh")) >= 0)
+    {
+        if (c == 'I')
+        {
+            if (!std::strcmp(optarg, "mmap")) input_mode = FastaIndex::MMAP;
+            else if (!std::strcmp(optarg, "mpiio")) input_mode = FastaIndex::MPIIO;
+            else
+            {
+                if (!myrank) std::cerr << "Error: unknown input mode " << std::quoted(optarg) << "\n" << std::endl;
+                if (!myrank) usage(argv[0]);
+                return -1;
+            }
+        }
+        else if (c == 'C')
+        {
+            cache_fname = optarg;
+        }
+        else if (c == 'L')
+        {
+            std::ifstream filestream(optarg);
+            std::string line;
+
+            if (!filestream.good())
+            {
+                if (!myrank) std::cerr << "Error: could not open " << std::quoted(optarg) << "\n" << std::endl;
+                return -1;
+            }
+
+            while (std::getline(filestream, line))
+            {
+                line.erase(line.find_last_not_of(" \t\r") + 1);
+                if (!line.empty()) input_fnames.push_back(line);
+            }
+        }
+        else if (c == 'M')
+        {
+            char *end;
+            membudget_gb = std::strtod(optarg, &end);
+
+            if (*end || membudget_gb <= 0)
+            {
+                if (!myrank) std::cerr << "Error: -M takes a positive number of GB, not " << std::quoted(optarg) << "\n" << std::endl;
+                return -1;
+            }
+        }
+        else if (c == 'S')
+        {
+            char *end;
+            stream_mbases = std::strtoull(optarg, &end, 10);
+
+            if (*end || !stream_mbases)
+            {
+                if (!myrank) std::cerr << "Error: -S takes a positive number of million nucleotides, not " << std::quoted(optarg) << "\n" << std::endl;
+                return -1;
+            }
+        }
+        else if (c == 'T')
+        {
+            scratch_dir = optarg;
+        }
+        else if (c == 'X')
+        {
+            char *end;
+            long len = std::strtol(optarg, &end, 10);
+
+            if (*end || len < KMER_SIZE || len > (1 << 16))
+            {
+                if (!myrank) std::cerr << "Error: -X takes a supermer length from " << KMER_SIZE << " to " << (1 << 16) << ", not " << std::quoted(optarg) << "\n" << std::endl;
+                return -1;
+            }
+
+            max_supermer_len = static_cast<int>(len);
+        }
+        else if (c == 'A')
+        {
+            char *end;
+            sketch_mb = std::strtod(optarg, &end);
+
+            if (*end || sketch_mb <= 0)
+            {
+                if (!myrank) std::cerr << "Error: -A takes a positive number of MB, not " << std::quoted(optarg) << "\n" << std::endl;
+                return -1;
+            }
+        }
+        else if (c == 'B')
+        {
+            drop_singletons = true;
+        }
+        else if (c == 'W')
+        {
+            write_faidx = true;
+        }
+        else
+        {
+            if (!myrank) usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (stream_mbases && membudget_gb)
+    {
+        if (!myrank) std::cerr << "Error: -S and -M can't be combined\n" << std::endl;
+        return -1;
+    }
+
+    if (stream_mbases && drop_singletons)
+    {
+        if (!myrank) std::cerr << "Error: -S and -B can't be combined\n" << std::endl;
+        return -1;
+    }
+
+    if (sketch_mb && (stream_mbases || membudget_gb || !scratch_dir.empty() || drop_singletons))
+    {
+        if (!myrank) std::cerr << "Error: -A can't be combined with -S, -M, -T or -B\n" << std::endl;
+        return -1;
+    }
+
+    input_fnames.insert(input_fnames.end(), argv + optind, argv + argc);
+
+    if (input_fnames.empty() && cache_fname.empty())
+    {
+        if (!myrank) usage(argv[0]);
+        return -1;
+    }
 
-    MPI_Finalize();
     return 0;
-}
\ No newline at end of file
+}
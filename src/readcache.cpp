@@ -0,0 +1,275 @@
+#include "readcache.hpp"
+#include "logger.hpp"
+#include "fileio.hpp"
+#include <algorithm>
+#include <numeric>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <mpi.h>
+
+constexpr char ReadCache::magic[8];
+
+ReadCache::ReadCache(const std::string& cache_fname, MPI_Comm comm) : comm(comm), cache_fname(cache_fname)
+{
+    MPI_Comm_size(comm, &nprocs);
+    MPI_Comm_rank(comm, &myrank);
+    readcounts.resize(nprocs, 0);
+    readdispls.resize(nprocs+1, 0);
+}
+
+bool ReadCache::iscache(const std::string& fname, MPI_Comm comm)
+{
+    int myrank;
+    int cache = 0;
+
+    MPI_Comm_rank(comm, &myrank);
+
+    if (myrank == 0)
+    {
+        Header header;
+        std::ifstream filestream(fname, std::ios::binary);
+        cache = filestream.read(reinterpret_cast<char*>(&header), sizeof(Header)) && !std::memcmp(header.magic, magic, sizeof(magic));
+    }
+
+    MPI_Bcast(&cache, 1, MPI_INT, 0, comm);
+    return cache;
+}
+
+void ReadCache::write(const DnaBuffer& mydna, const std::vector<size_t>& overlaps) const
+{
+    /*
+     * A read's overlap is left out, which leaves whole bytes (see the class
+     * comment). Without overlaps the DnaBuffer storage is written as is,
+     * otherwise the stored part of every read is gathered first.
+     */
+    size_t numreads = mydna.size();
+    std::vector<uint64_t> readlens(numreads);
+    bool overlapping = false;
+
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        size_t overlap = overlaps.empty()? 0 : overlaps[i];
+        readlens[i] = mydna[i].size() - overlap;
+        if (overlap > 0) readlens[i] |= CONTINUED;
+        overlapping = overlapping || overlap > 0;
+    }
+
+    std::vector<uint8_t> stored;
+
+    if (overlapping)
+    {
+        for (size_t i = 0; i < numreads; ++i)
+        {
+            const uint8_t *mem = mydna.getbufoffset(i);
+            stored.insert(stored.end(), mem, mem + DnaSeq::bytesneeded(readlens[i] & ~CONTINUED));
+        }
+    }
+
+    uint64_t mycounts[2] = {numreads, overlapping? stored.size() : numreads? mydna.getrangebufsize(0, numreads) : 0};
+    uint64_t countsbefore[2] = {0, 0}, totcounts[2];
+    char const *mybuf = overlapping? reinterpret_cast<char const*>(stored.data()) : reinterpret_cast<char const*>(numreads? mydna.getbufoffset(0) : nullptr);
+
+    MPI_Exscan(mycounts, countsbefore, 2, MPI_UINT64_T, MPI_SUM, comm);
+    MPI_Allreduce(mycounts, totcounts, 2, MPI_UINT64_T, MPI_SUM, comm);
+    if (myrank == 0) countsbefore[0] = countsbefore[1] = 0;
+
+    MPI_File fh;
+
+    if (MPI_File_open(comm, cache_fname.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+        if (myrank == 0) std::cerr << "Error: could not create read cache " << std::quoted(cache_fname) << std::endl;
+        MPI_Abort(comm, 1);
+    }
+
+    MPI_File_set_size(fh, 0);
+
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.numreads = totcounts[0];
+    header.numbytes = totcounts[1];
+
+    MPI_Offset lenspos = sizeof(Header);
+    MPI_Offset bufpos = lenspos + header.numreads * sizeof(uint64_t);
+
+    write_at_all_chunked(fh, 0, reinterpret_cast<char const*>(&header), myrank == 0? sizeof(Header) : 0, comm);
+    write_at_all_chunked(fh, lenspos + countsbefore[0] * sizeof(uint64_t), reinterpret_cast<char const*>(readlens.data()), readlens.size() * sizeof(uint64_t), comm);
+    write_at_all_chunked(fh, bufpos + countsbefore[1], mycounts[1]? mybuf : nullptr, mycounts[1], comm);
+
+    MPI_File_close(&fh);
+
+    #if LOG_LEVEL >= 2
+    Logger logger(comm);
+    logger() << "wrote " << header.numreads << " reads (" << header.numbytes << " bytes of 2-bit sequence) to " << std::quoted(cache_fname);
+    logger.flush("Read cache:", 0);
+    #endif
+}
+
+DnaBuffer ReadCache::getmydna()
+{
+    MPI_File fh;
+    Header header;
+
+    if (MPI_File_open(comm, cache_fname.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+        if (myrank == 0) std::cerr << "Error: could not open read cache " << std::quoted(cache_fname) << std::endl;
+        MPI_Abort(comm, 1);
+    }
+
+    if (myrank == 0) read_at_chunked(fh, 0, reinterpret_cast<char*>(&header), sizeof(Header));
+    MPI_Bcast(&header, sizeof(Header), MPI_BYTE, 0, comm);
+
+
+    MPI_Offset lenspos = sizeof(Header);
+    MPI_Offset bufpos = lenspos + header.numreads * sizeof(uint64_t);
+
+    /*
+     * First everyone reads an equal share of the read lengths. Reads are then
+     * assigned like FastaIndex::getpartition does with bases: a read goes to
+     * the processor whose 1/nprocs slice of the sequence bytes contains its
+     * midpoint, so owners are non-decreasing and each processor ends up with
+     * a contiguous range of reads (and bytes).
+     */
+    uint64_t lenstart = (header.numreads * myrank) / nprocs;
+    uint64_t lenend = (header.numreads * (myrank+1)) / nprocs;
+
+    std::vector<uint64_t> lens(lenend - lenstart);
+    read_at_all_chunked(fh, lenspos + lenstart * sizeof(uint64_t), reinterpret_cast<char*>(lens.data()), lens.size() * sizeof(uint64_t), comm);
+
+    /*
+     * A continued read gets the KMER_SIZE-1 bases that follow it in its record
+     * (fewer if the record ends sooner) as its overlap. Those of my share's
+     * last read can come from the shares after mine, so everyone tells how many
+     * bases its first record has in its share, and whether it ends there.
+     */
+    constexpr uint64_t maxoverlap = KMER_SIZE-1;
+    uint64_t head[2] = {0, 0};
+
+    for (uint64_t len : lens)
+    {
+        head[0] = std::min(maxoverlap, head[0] + (len & ~CONTINUED));
+        if (!(len & CONTINUED)) { head[1] = 1; break; }
+    }
+
+    std::vector<uint64_t> heads(2*nprocs);
+    MPI_Allgather(head, 2, MPI_UINT64_T, heads.data(), 2, MPI_UINT64_T, comm);
+
+    uint64_t after = 0; /* bases following a read in its record, up to maxoverlap */
+
+    for (int i = myrank+1; i < nprocs && after < maxoverlap; ++i)
+    {
+        after = std::min(maxoverlap, after + heads[2*i]);
+        if (heads[2*i+1]) break;
+    }
+
+    std::vector<uint64_t> overlaps(lens.size());
+
+    for (size_t i = lens.size(); i-- > 0; )
+    {
+        bool continued = lens[i] & CONTINUED;
+        lens[i] &= ~CONTINUED;
+        overlaps[i] = continued? after : 0;
+        after = std::min(maxoverlap, lens[i] + overlaps[i]);
+    }
+
+    uint64_t mybytes = 0, bytesbefore = 0;
+
+    for (uint64_t len : lens)
+        mybytes += DnaSeq::bytesneeded(len);
+
+    MPI_Exscan(&mybytes, &bytesbefore, 1, MPI_UINT64_T, MPI_SUM, comm);
+    if (myrank == 0) bytesbefore = 0;
+
+    double avgbytesperproc = static_cast<double>(header.numbytes) / nprocs;
+    std::vector<MPI_Count_t> sendcounts(nprocs, 0), recvcounts(nprocs);
+    std::vector<MPI_Offset_t> sdispls(nprocs), rdispls(nprocs);
+
+    for (uint64_t len : lens)
+    {
+        uint64_t nbytes = DnaSeq::bytesneeded(len);
+        double midpoint = bytesbefore + nbytes / 2.0;
+        int owner = avgbytesperproc > 0? std::min(nprocs-1, static_cast<int>(midpoint / avgbytesperproc)) : 0;
+        sendcounts[owner]++;
+        bytesbefore += nbytes;
+    }
+
+    MPI_Alltoall(sendcounts.data(), 1, MPI_COUNT_TYPE, recvcounts.data(), 1, MPI_COUNT_TYPE, comm);
+
+    std::exclusive_scan(sendcounts.begin(), sendcounts.end(), sdispls.begin(), static_cast<MPI_Offset_t>(0));
+    std::exclusive_scan(recvcounts.begin(), recvcounts.end(), rdispls.begin(), static_cast<MPI_Offset_t>(0));
+
+    std::vector<uint64_t> mylens(rdispls.back() + recvcounts.back());
+    std::vector<uint64_t> myoverlaps(mylens.size());
+    alltoallv_large(lens.data(), sendcounts, sdispls, mylens.data(), recvcounts, rdispls, MPI_UINT64_T, comm);
+    alltoallv_large(overlaps.data(), sendcounts, sdispls, myoverlaps.data(), recvcounts, rdispls, MPI_UINT64_T, comm);
+
+    /*
+     * My reads are contiguous, so my bytes start where everyone before me
+     * ends, and arrive with one collective read. A continued read's overlap
+     * is what follows it in the file, so reading on to the end of my last
+     * read's overlap covers all of them. Without overlaps that read goes
+     * straight into the DnaBuffer storage, otherwise every read is copied
+     * into its slot, with the bits past its last base cleared.
+     */
+    size_t numreads = mylens.size();
+    std::vector<size_t> readlens(numreads);
+    uint64_t mystored = 0, bufbefore = 0;
+    bool overlapping = false;
+
+    for (size_t i = 0; i < numreads; ++i)
+    {
+        readlens[i] = mylens[i] + myoverlaps[i];
+        mystored += DnaSeq::bytesneeded(mylens[i]);
+        overlapping = overlapping || myoverlaps[i] > 0;
+    }
+
+    MPI_Exscan(&mystored, &bufbefore, 1, MPI_UINT64_T, MPI_SUM, comm);
+    if (myrank == 0) bufbefore = 0;
+
+    size_t bufsize = DnaBuffer::computebufsize(readlens);
+    size_t readsize = numreads? mystored - DnaSeq::bytesneeded(mylens.back()) + DnaSeq::bytesneeded(readlens.back()) : 0;
+
+    uint8_t *buf = new uint8_t[bufsize];
+    std::vector<uint8_t> stored(overlapping? readsize : 0);
+    read_at_all_chunked(fh, bufpos + bufbefore, reinterpret_cast<char*>(overlapping? stored.data() : buf), readsize, comm);
+
+    MPI_File_close(&fh);
+
+    if (overlapping)
+    {
+        size_t src = 0, dest = 0;
+
+        for (size_t i = 0; i < numreads; ++i)
+        {
+            size_t nbytes = DnaSeq::bytesneeded(readlens[i]);
+            std::memcpy(buf + dest, stored.data() + src, nbytes);
+            if (readlens[i] % 4) buf[dest + nbytes - 1] &= static_cast<uint8_t>(0xff << (8 - 2 * (readlens[i] % 4)));
+            src += DnaSeq::bytesneeded(mylens[i]);
+            dest += nbytes;
+        }
+    }
+
+    DnaBuffer dnabuf(bufsize, numreads, buf, readlens.data());
+
+    /*
+     * Every processor gets a copy of the read counts and displacements.
+     */
+    MPI_Count_t mycount = numreads;
+    MPI_Allgather(&mycount, 1, MPI_COUNT_TYPE, readcounts.data(), 1, MPI_COUNT_TYPE, comm);
+
+    std::exclusive_scan(readcounts.begin(), readcounts.end(), readdispls.begin(), static_cast<MPI_Offset_t>(0));
+    readdispls.back() = readdispls[nprocs-1] + readcounts.back();
+
+    #if LOG_LEVEL >= 2
+    Logger logger(comm);
+    size_t mytotbases = std::accumulate(readlens.begin(), readlens.end(), static_cast<size_t>(0));
+    size_t totbases;
+    MPI_Allreduce(&mytotbases, &totbases, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    double percent_proportion = (static_cast<double>(mytotbases) / totbases) * 100.0;
+    logger() << " is responsible for sequences " << Logger::readrangestr(readdispls[myrank], readcounts[myrank]) << " (" << mytotbases << " nucleotides, " << std::fixed << std::setprecision(3) << percent_proportion << "%)";
+    logger.flush("Read cache:");
+    #endif
+
+    return dnabuf;
+}